@@ -16,7 +16,194 @@ returns TABLE(average double precision, minimum double precision, maximum double
 as 'MODULE_PATHNAME'
 LANGUAGE C IMMUTABLE;
 
-CREATE OR REPLACE FUNCTION kplusplus(double precision[], int, int, int)
+CREATE OR REPLACE FUNCTION kplusplus(double precision[], int, int, int, cluster int DEFAULT NULL, seed bigint DEFAULT NULL)
 returns TABLE(average double precision, minimum double precision, maximum double precision, standarddev double precision, numcount int)
 as 'MODULE_PATHNAME'
 LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION kexact(double precision[], int)
+returns TABLE(average double precision, minimum double precision, maximum double precision, standarddev double precision, numcount int)
+as 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION kexact_all(double precision[], int)
+returns TABLE(cluster_number integer, average double precision, minimum double precision, maximum double precision, stddev double precision, numcount integer)
+as 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION kplusplus_instrumentation()
+returns TABLE(counter text, value bigint)
+as 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE;
+
+CREATE OR REPLACE FUNCTION kplusplus_instrumentation_reset()
+returns void
+as 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE;
+
+-- Result caches: timecache.kplusplus_cache_size per backend, and with the library in shared_preload_libraries
+-- timecache.kplusplus_shared_cache_size across backends. See kcache.c and kshared.c
+CREATE OR REPLACE FUNCTION kplusplus_cache_stats()
+returns TABLE(cache text, entries bigint, hits bigint, misses bigint, hit_ratio double precision, evictions bigint, expirations bigint, memory_bytes bigint, memory_limit_bytes bigint)
+as 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE;
+
+CREATE OR REPLACE VIEW kplusplus_cache AS
+SELECT * FROM kplusplus_cache_stats();
+
+CREATE OR REPLACE FUNCTION kplusplus_cache_entries()
+returns TABLE(series text, function text, points int, k int, seeds int, updates int, seed bigint, hits bigint, bytes bigint, stored timestamp with time zone)
+as 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE;
+
+CREATE OR REPLACE FUNCTION kplusplus_cache_invalidate(series text DEFAULT NULL)
+returns bigint
+as 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE;
+
+CREATE OR REPLACE FUNCTION kplusplus_cache_prewarm(series text, double precision[], int, int, int, seed bigint)
+returns boolean
+as 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE;
+
+CREATE OR REPLACE FUNCTION kplusplus_cache_prewarm(series text, real[], int, int, int, seed bigint)
+returns boolean
+as 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE;
+
+CREATE OR REPLACE FUNCTION kplusplus_all(double precision[], int, int, int, seed bigint DEFAULT NULL)
+returns TABLE(cluster_number integer, average double precision, minimum double precision, maximum double precision, stddev double precision, numcount integer)
+as 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION knear(double precision[], int, int, int, double precision, int, seed bigint DEFAULT NULL)
+returns TABLE(average double precision, minimum double precision, maximum double precision, standarddev double precision, numcount int)
+as 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION knear_avg(double precision[], int, int, int, double precision, int, seed bigint DEFAULT NULL)
+returns double precision
+as 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION kdynamic(double precision[], middle double precision, seed bigint DEFAULT NULL)
+returns TABLE(average double precision, minimum double precision, maximum double precision, standarddev double precision, numcount int, k int)
+as 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE;
+
+-- real[] overloads: float4 arrays are clustered as float4 instead of being cast to float8 first
+CREATE OR REPLACE FUNCTION kplusplus(real[], int, int, int, cluster int DEFAULT NULL, seed bigint DEFAULT NULL)
+returns TABLE(average double precision, minimum double precision, maximum double precision, standarddev double precision, numcount int)
+as 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION kplusplus_all(real[], int, int, int, seed bigint DEFAULT NULL)
+returns TABLE(cluster_number integer, average double precision, minimum double precision, maximum double precision, stddev double precision, numcount integer)
+as 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION knear(real[], int, int, int, double precision, int, seed bigint DEFAULT NULL)
+returns TABLE(average double precision, minimum double precision, maximum double precision, standarddev double precision, numcount int)
+as 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION knear_avg(real[], int, int, int, double precision, int, seed bigint DEFAULT NULL)
+returns double precision
+as 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION kdynamic(real[], middle double precision, seed bigint DEFAULT NULL)
+returns TABLE(average double precision, minimum double precision, maximum double precision, standarddev double precision, numcount int, k int)
+as 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE;
+
+-- kplusplus_agg: kplusplus_all as an aggregate over rows, one kcluster per cluster. See kagg.c
+CREATE TYPE kcluster AS (cluster_number integer, average double precision, minimum double precision, maximum double precision, stddev double precision, numcount integer);
+
+CREATE OR REPLACE FUNCTION kplusplus_agg_transfn(internal, double precision, int, int, int)
+returns internal
+as 'MODULE_PATHNAME'
+LANGUAGE C PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kplusplus_agg_transfn(internal, double precision, int, int, int, bigint)
+returns internal
+as 'MODULE_PATHNAME'
+LANGUAGE C PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kplusplus_agg_combinefn(internal, internal)
+returns internal
+as 'MODULE_PATHNAME'
+LANGUAGE C PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kplusplus_agg_serialfn(internal)
+returns bytea
+as 'MODULE_PATHNAME'
+LANGUAGE C STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kplusplus_agg_deserialfn(bytea, internal)
+returns internal
+as 'MODULE_PATHNAME'
+LANGUAGE C STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION kplusplus_agg_finalfn(internal)
+returns kcluster[]
+as 'MODULE_PATHNAME'
+LANGUAGE C PARALLEL SAFE;
+
+-- e.g. SELECT series_id, (unnest(kplusplus_agg(value, 3, 10, 50))).* FROM metrics GROUP BY series_id
+CREATE OR REPLACE AGGREGATE kplusplus_agg(double precision, int, int, int) (
+	SFUNC = kplusplus_agg_transfn,
+	STYPE = internal,
+	FINALFUNC = kplusplus_agg_finalfn,
+	COMBINEFUNC = kplusplus_agg_combinefn,
+	SERIALFUNC = kplusplus_agg_serialfn,
+	DESERIALFUNC = kplusplus_agg_deserialfn,
+	PARALLEL = SAFE
+);
+
+CREATE OR REPLACE AGGREGATE kplusplus_agg(double precision, int, int, int, seed bigint) (
+	SFUNC = kplusplus_agg_transfn,
+	STYPE = internal,
+	FINALFUNC = kplusplus_agg_finalfn,
+	COMBINEFUNC = kplusplus_agg_combinefn,
+	SERIALFUNC = kplusplus_agg_serialfn,
+	DESERIALFUNC = kplusplus_agg_deserialfn,
+	PARALLEL = SAFE
+);
+
+-- Weighted points: values[i] counted weights[i] times, e.g. histogram buckets. numcount is the total weight. See kweighted.c
+CREATE OR REPLACE FUNCTION kplusplus_weighted(double precision[], double precision[], int, int, int, cluster int DEFAULT NULL, seed bigint DEFAULT NULL)
+returns TABLE(average double precision, minimum double precision, maximum double precision, standarddev double precision, numcount int)
+as 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION kplusplus_weighted_all(double precision[], double precision[], int, int, int, seed bigint DEFAULT NULL)
+returns TABLE(cluster_number integer, average double precision, minimum double precision, maximum double precision, stddev double precision, numcount integer)
+as 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION ksimple_weighted(double precision[], double precision[], int)
+returns TABLE(average double precision, minimum double precision, maximum double precision, standarddev double precision, numcount int)
+as 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION kexact_weighted(double precision[], double precision[], int)
+returns TABLE(average double precision, minimum double precision, maximum double precision, standarddev double precision, numcount int)
+as 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION knear_weighted(double precision[], double precision[], int, int, int, double precision, int, seed bigint DEFAULT NULL)
+returns TABLE(average double precision, minimum double precision, maximum double precision, standarddev double precision, numcount int)
+as 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE;
+
+-- Approximate kexact from a histogram of the values, for very large arrays. bin_width is the resolution of the band edges. See kbinned.c
+CREATE OR REPLACE FUNCTION kbinned(double precision[], int, bins int DEFAULT 4096)
+returns TABLE(average double precision, minimum double precision, maximum double precision, standarddev double precision, numcount int, bin_width double precision)
+as 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION kbinned_all(double precision[], int, bins int DEFAULT 4096)
+returns TABLE(cluster_number integer, average double precision, minimum double precision, maximum double precision, stddev double precision, numcount integer, bin_width double precision)
+as 'MODULE_PATHNAME'
+LANGUAGE C IMMUTABLE;
@@ -0,0 +1,106 @@
+#include "arrayinput.h"
+
+/**
+* Reading FLOAT8/FLOAT4/INT8/INT4 arrays as doubles
+*
+* A float8 array without nulls already is a double array: its data is used in place, no copy.
+* Other element types are widened straight from the array data in one pass, except that
+* get_array_values() also keeps float4 data in place for the kernels that handle it natively.
+* Nulls are never allowed, the first one is reported with its index.
+*
+* Values returned in place belong to the array (possibly a shared buffer): callers must never write to them,
+* and release them with free_converted_array().
+*/
+
+/// <summary>
+/// Error on the first null element, if there is one
+/// </summary>
+void check_array_nulls(ArrayType* arr, int array_length)
+{
+	bits8* bitmap = ARR_NULLBITMAP(arr);
+	if (bitmap == NULL)
+		return;
+
+	for (int i = 0; i < array_length; i++)
+	{
+		if ((bitmap[i / 8] & (1 << (i % 8))) == 0)
+			ereport(ERROR, errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED), errmsg("Null value in array at index %d", i));
+	}
+}
+
+/// <summary>
+/// The array as doubles, in place for float8
+/// </summary>
+/// <param name="arr">1-dimensional array</param>
+/// <param name="valueType">ARR_ELEMTYPE(arr)</param>
+/// <param name="array_length">element count</param>
+/// <returns>array_length values, read-only</returns>
+double* get_converted_array(ArrayType* arr, Oid valueType, int array_length)
+{
+	// Without nulls the elements are stored back to back, aligned for their type
+	check_array_nulls(arr, array_length);
+
+	if (valueType == FLOAT8OID)
+		return (double*)ARR_DATA_PTR(arr);
+
+	double* convArray = palloc(sizeof(double) * array_length);
+	switch (valueType)
+	{
+	case FLOAT4OID:
+	{
+		float4* src = (float4*)ARR_DATA_PTR(arr);
+		for (int i = 0; i < array_length; i++)
+			convArray[i] = (double)src[i];
+		break;
+	}
+	case INT8OID:
+	{
+		int64* src = (int64*)ARR_DATA_PTR(arr);
+		for (int i = 0; i < array_length; i++)
+			convArray[i] = (double)src[i];
+		break;
+	}
+	case INT4OID:
+	{
+		int32* src = (int32*)ARR_DATA_PTR(arr);
+		for (int i = 0; i < array_length; i++)
+			convArray[i] = (double)src[i];
+		break;
+	}
+	default:
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Unsupported OID type, only FLOAT8/FLOAT4/INT8/INT4 allowed"));
+	}
+
+	return convArray;
+}
+
+/// <summary>
+/// Release values from get_converted_array(), unless they are the array's own data
+/// </summary>
+void free_converted_array(ArrayType* arr, double* values)
+{
+	if ((char*)values != ARR_DATA_PTR(arr))
+		pfree(values);
+}
+
+/// <summary>
+/// get_converted_array(), but float4 arrays are returned in place as float4
+/// </summary>
+KValues get_array_values(ArrayType* arr, Oid valueType, int array_length)
+{
+	KValues values = { NULL, NULL };
+	if (valueType == FLOAT4OID)
+	{
+		check_array_nulls(arr, array_length);
+		values.f4 = (float4*)ARR_DATA_PTR(arr);
+	}
+	else
+		values.f8 = get_converted_array(arr, valueType, array_length);
+	return values;
+}
+
+void free_array_values(ArrayType* arr, KValues values)
+{
+	if (values.f8 != NULL)
+		free_converted_array(arr, values.f8);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "timecache.h"
+
+/**
+* Numeric array input shared by every SQL function taking points
+*
+* Implemented in arrayinput.c
+*/
+
+// Point values as float8, or as float4 read in place from a float4[] argument.
+// Exactly one of f8 and f4 is set.
+typedef struct
+{
+	double* f8;
+	float4* f4;
+} KValues;
+
+static inline double kvalue(KValues v, int i)
+{
+	return v.f4 != NULL ? (double)v.f4[i] : v.f8[i];
+}
+
+static inline KValues kvalues_f8(double* values)
+{
+	KValues v = { values, NULL };
+	return v;
+}
+
+static inline KValues kvalues_f4(float4* values)
+{
+	KValues v = { NULL, values };
+	return v;
+}
+
+double* get_converted_array(ArrayType* arr, Oid valueType, int array_length);
+void free_converted_array(ArrayType* arr, double* values);
+KValues get_array_values(ArrayType* arr, Oid valueType, int array_length);
+void free_array_values(ArrayType* arr, KValues values);
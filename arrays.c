@@ -1,4 +1,5 @@
 #include "timecache.h"
+#include "arrayinput.h"
 
 /**
 *  Array helper methods
@@ -72,121 +73,21 @@ Datum quadrants_from_points(PG_FUNCTION_ARGS)
 		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Quadrant index array length not the expected 5. Input point array contained %d elements", indexArrayLength));
 	}
 
-	// Convert points
-	bool* pNullFlags;
-	int16 pValueTypeWidth;
-	bool pValueTypeByValue;
-	char pValueTypeAlignCode;
-	Datum* pValueContent;
-
-	get_typlenbyvalalign(pointValueType, &pValueTypeWidth, &pValueTypeByValue, &pValueTypeAlignCode);
-	deconstruct_array(parr, pointValueType, pValueTypeWidth, pValueTypeByValue, pValueTypeAlignCode, &pValueContent, &pNullFlags, &pointArrayLength);
-
-	// Convert Quad indices
-	bool* iNullFlags;
-	int16 iValueTypeWidth;
-	bool iValueTypeByValue;
-	char iValueTypeAlignCode;
-	Datum* iValueContent;
-
-	get_typlenbyvalalign(indexValueType, &iValueTypeWidth, &iValueTypeByValue, &iValueTypeAlignCode);
-	deconstruct_array(iarr, indexValueType, iValueTypeWidth, iValueTypeByValue, iValueTypeAlignCode, &iValueContent, &iNullFlags, &indexArrayLength);
-
-	float8* convertedPointArray = palloc0(sizeof(float8) * pointArrayLength);
-	switch (pointValueType)
-	{
-	case FLOAT8OID:
-		for (int i = 0; i < pointArrayLength; i++)
-		{
-			if (pNullFlags[i])
-			{
-				//TODO: Allow nulls and treat as zero?
-				ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Null value in point array at index %d", i));
-			}
-			convertedPointArray[i] = DatumGetFloat8(pValueContent[i]);
-		}
-		break;
-	case FLOAT4OID:
-		for (int i = 0; i < pointArrayLength; i++)
-		{
-			if (pNullFlags[i])
-			{
-				//TODO: Allow nulls and treat as zero?
-				ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Null value in point array at index %d", i));
-			}
-			convertedPointArray[i] = (float8)DatumGetFloat4(pValueContent[i]);
-		}
-		break;
-	case INT8OID:
-		for (int i = 0; i < pointArrayLength; i++)
-		{
-			if (pNullFlags[i])
-			{
-				//TODO: Allow nulls and treat as zero?
-				ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Null value in point array at index %d", i));
-			}
-			convertedPointArray[i] = (float8)DatumGetInt64(pValueContent[i]);
-		}
-		break;
-	case INT4OID:
-		for (int i = 0; i < pointArrayLength; i++)
-		{
-			if (pNullFlags[i])
-			{
-				//TODO: Allow nulls and treat as zero?
-				ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Null value in point array at index %d", i));
-			}
-			convertedPointArray[i] = (float8)DatumGetInt32(pValueContent[i]);
-		}
-		break;
-	default:
-		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Unsupported OID type, only FLOAT8/FLOAT4/INT8/INT4 allowed"));
-		break;
-	}
-
-
-	int32* convertedIndexArray = palloc0(sizeof(int32) * indexArrayLength);
-	switch (indexValueType)
-	{
-	case INT8OID:
-		for (int i = 0; i < indexArrayLength; i++)
-		{
-			if (iNullFlags[i])
-			{
-				//TODO: Allow nulls and treat as zero?
-				ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Null value in index array at index %d", i));
-			}
-			convertedIndexArray[i] = (int32)DatumGetInt64(iValueContent[i]);
-		}
-		break;
-	case INT4OID:
-		for (int i = 0; i < indexArrayLength; i++)
-		{
-			if (iNullFlags[i])
-			{
-				//TODO: Allow nulls and treat as zero?
-				ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Null value in index array at index %d", i));
-			}
-			convertedIndexArray[i] = (int32)DatumGetInt32(iValueContent[i]);
-		}
-		break;
-	default:
-		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Unsupported OID type for index, only INT8/INT4 allowed"));
-		break;
-	}
+	float8* convertedPointArray = get_converted_array(parr, pointValueType, pointArrayLength);
+	float8* convertedIndexArray = get_converted_array(iarr, indexValueType, indexArrayLength);
 
 	float8* ret = palloc0(sizeof(float8) * indexArrayLength);
 	for (int i = 0; i < indexArrayLength; i++)
 	{
-		int qidx = convertedIndexArray[i];
+		double qidx = convertedIndexArray[i];
 		if (qidx > 671 || qidx < 0)
 		{
-			ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Invalid value in index array at position %d, value must be [0-671], received: %d", i, qidx));
+			ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Invalid value in index array at position %d, value must be [0-671], received: %.0f", i, qidx));
 		}
-		ret[i] = convertedPointArray[convertedIndexArray[i]];
+		ret[i] = convertedPointArray[(int)qidx];
 	}
-	pfree(convertedPointArray);
-	pfree(convertedIndexArray);
+	free_converted_array(parr, convertedPointArray);
+	free_converted_array(iarr, convertedIndexArray);
 
 
 	Datum* datum = palloc0(sizeof(Datum) * indexArrayLength);
@@ -295,69 +196,7 @@ int order_ints(const void* a, const void* b)
 
 
 
-	// Convert points
-	bool* pNullFlags;
-	int16 pValueTypeWidth;
-	bool pValueTypeByValue;
-	char pValueTypeAlignCode;
-	Datum* pValueContent;
-
-	get_typlenbyvalalign(pointValueType, &pValueTypeWidth, &pValueTypeByValue, &pValueTypeAlignCode);
-	deconstruct_array(parr, pointValueType, pValueTypeWidth, pValueTypeByValue, pValueTypeAlignCode, &pValueContent, &pNullFlags, &pointArrayLength);
-
-
-	float8* convertedPointArray = palloc0(sizeof(float8) * pointArrayLength);
-	switch (pointValueType)
-	{
-	case FLOAT8OID:
-		for (int i = 0; i < pointArrayLength; i++)
-		{
-			if (pNullFlags[i])
-			{
-				//TODO: Allow nulls and treat as zero?
-				ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Null value in point array at index %d", i));
-			}
-			convertedPointArray[i] = DatumGetFloat8(pValueContent[i]);
-		}
-		break;
-	case FLOAT4OID:
-		for (int i = 0; i < pointArrayLength; i++)
-		{
-			if (pNullFlags[i])
-			{
-				//TODO: Allow nulls and treat as zero?
-				ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Null value in point array at index %d", i));
-			}
-			convertedPointArray[i] = (float8)DatumGetFloat4(pValueContent[i]);
-		}
-		break;
-	case INT8OID:
-		for (int i = 0; i < pointArrayLength; i++)
-		{
-			if (pNullFlags[i])
-			{
-				//TODO: Allow nulls and treat as zero?
-				ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Null value in point array at index %d", i));
-			}
-			convertedPointArray[i] = (float8)DatumGetInt64(pValueContent[i]);
-		}
-		break;
-	case INT4OID:
-		for (int i = 0; i < pointArrayLength; i++)
-		{
-			if (pNullFlags[i])
-			{
-				//TODO: Allow nulls and treat as zero?
-				ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Null value in point array at index %d", i));
-			}
-			convertedPointArray[i] = (float8)DatumGetInt32(pValueContent[i]);
-		}
-		break;
-	default:
-		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Unsupported OID type, only FLOAT8/FLOAT4/INT8/INT4 allowed"));
-		break;
-	}
-	pfree(convertedPointArray);
+	float8* convertedPointArray = get_converted_array(parr, pointValueType, pointArrayLength);
 
 	int k = PG_GETARG_INT32(1);
 	int originalK = k;
@@ -366,6 +205,7 @@ int order_ints(const void* a, const void* b)
 
 	// TODO: Biggest breaks...
 	int* kBig = kbig(convertedPointArray, pointArrayLength, k);
+	free_converted_array(parr, convertedPointArray);
 
 
 	qsort(kBig, k, sizeof(int), order_ints);
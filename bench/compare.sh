@@ -0,0 +1,31 @@
+#!/bin/sh
+#
+# Compare two bench/run.sh result files, run on the same workload
+#
+#   bench/compare.sh bench/results/v1.csv bench/results/v2.csv
+#
+# One row per script and lateral in both: tps and p99 latency of each, and the tps ratio new / old.
+# Where a file has several rows for the same script and lateral, the last one counts.
+
+if [ $# -ne 2 ]; then
+	echo "usage: compare.sh old.csv new.csv" >&2
+	exit 2
+fi
+
+awk -F, '
+	FNR == 1 { file++; next }
+	file == 1 { old_tps[$3 "," $4] = $9; old_p99[$3 "," $4] = $13; old_series[$3 "," $4] = $5 }
+	file == 2 { new_tps[$3 "," $4] = $9; new_p99[$3 "," $4] = $13; new_series[$3 "," $4] = $5; order[++n] = $3 "," $4 }
+	END {
+		print "script,lateral,old_tps,new_tps,tps_ratio,old_p99_ms,new_p99_ms"
+		for (i = 1; i <= n; i++) {
+			key = order[i]
+			if (key in seen || !(key in old_tps))
+				continue
+			seen[key] = 1
+			if (old_series[key] != new_series[key])
+				printf "%s: different SERIES, %s and %s\n", key, old_series[key], new_series[key] > "/dev/stderr"
+			ratio = old_tps[key] > 0 ? new_tps[key] / old_tps[key] : 0
+			printf "%s,%s,%s,%.3f,%s,%s\n", key, old_tps[key], new_tps[key], ratio, old_p99[key], new_p99[key]
+		}
+	}' "$1" "$2"
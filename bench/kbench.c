@@ -0,0 +1,655 @@
+#include "kshim.h"
+#include "kplusplus.h"
+#include "ksimd.h"
+#include "kpool.h"
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+* Clustering kernel benchmark, without a server
+*
+* Runs the kernels behind the SQL functions on synthetic arrays and prints one CSV row per
+* function, distribution, array length and k:
+*
+*   function,distribution,n,k,threads,runs,ns_per_call,ns_per_point,iterations,restarts,peak_memory,score
+*
+* ns_per_call and ns_per_point are the mean time of one call. iterations and restarts are the
+* mean kinstrumentation counts of one call (kplusplus only), peak_memory the most bytes palloc()'d
+* by one call, result included (see kshim_memory_peak()). score is the within-cluster sum of squares
+* of the clusters returned, lower is better, for the functions that return clusters (empty for kbig and getkindices).
+* Every call of a case is seeded the same, so it is the same on every run. threads is
+* timecache.kplusplus_threads for the row: -t takes a comma separated list, and every case runs once per entry.
+*
+* Distributions, all generated from a fixed seed so every run sees the same arrays:
+*   uniform   - uniform in [0, 1000)
+*   bimodal   - 70% normal(100, 10), 30% normal(300, 20)
+*   sine672   - a week of 15 minute quadrants (672 points, see arrays.c): daily and weekly sine waves plus noise, repeated
+*   latency   - lognormal response times with a 1% Pareto tail
+*
+* Array lengths are 672, 10k, 100k, 1M and 10M, up to -n. Each case runs at least -r times,
+* and short arrays repeat until about a million points have been clustered.
+*
+* kplusplus on 672 points with k <= 3 is the quadrant shape of arrays.c, most calls in production. Up to the default
+* 10 restarts of 50 updates, those rows must stay under KBENCH_TARGET_672_NS per call: kbench reports the rows over it
+* on stderr and exits with status 1.
+*
+* Usage: kbench [-n max_points] [-r runs] [-k max_k] [-s seeds] [-u updates] [-t threads[,threads...]] [-m simd]
+*               [-S sample_threshold] [-b batch_size] [-P parallel_threshold] [-B bounded_threshold] [-L small_limit] [-4]
+*               [-f function] [-d distribution] [-V]
+*
+* -S sets timecache.kplusplus_sample_threshold: -1 seeds from every point, 0 always from k-means|| where k is large enough.
+* -b sets timecache.kplusplus_batch_size (mini-batch rounds, 0 runs Lloyd's iteration), -P timecache.kplusplus_parallel_threshold.
+* -B sets timecache.kplusplus_bounded_threshold: -1 turns off the moving boundaries, so every restart of the general
+* path reassigns every point. -L sets timecache.kplusplus_small_limit: 0 turns off the fixed-k quadrant path.
+* -V checks every SIMD kernel the CPU has against the scalar reference instead of timing anything (see kbench_verify()).
+* -4 gives kplusplus the generated values as float4[] input, rounded to float4, instead of float8[]. The other functions
+* only take float8 and keep their input.
+* Settings not given on the command line keep their timecache.* GUC defaults.
+*/
+#undef printf
+#undef fprintf
+
+void _PG_init(void);
+
+// Fixed seed of the generated arrays and of every kplusplus call
+#define KBENCH_SEED 20210701
+
+// Points clustered per case at least, for short arrays
+#define KBENCH_POINTS 1000000
+
+// internal_kdynamic() and getKIndices() share of the sorted points kept for the middle average
+#define KBENCH_DYNAMIC_PERC 0.9
+
+// Most nanoseconds per call for kplusplus on the 672 point, k <= 3 quadrant shape, up to 10 restarts of 50 updates
+#define KBENCH_TARGET_672_NS 150000
+
+// Length of the -V arrays, odd so every vector width leaves a tail
+#define KBENCH_VERIFY_POINTS 10007
+
+// Longest prefix -V runs every kernel on one length at a time, to cover every tail length
+#define KBENCH_VERIFY_TAILS 67
+
+// Largest k -V checks the kernels with
+#define KBENCH_VERIFY_MAX_K 17
+
+static const int kbench_lengths[] = { 672, 10000, 100000, 1000000, 10000000 };
+static const char* kbench_distributions[] = { "uniform", "bimodal", "sine672", "latency" };
+
+#define KBENCH_LENGTHS (sizeof(kbench_lengths) / sizeof(kbench_lengths[0]))
+#define KBENCH_DISTRIBUTIONS (sizeof(kbench_distributions) / sizeof(kbench_distributions[0]))
+
+typedef struct
+{
+	int max_points;
+	int runs;
+	int max_k;
+	int seeds;
+	int updates;
+	// timecache.kplusplus_threads values to run every case with
+	int threads[KPOOL_MAX_THREADS];
+	int thread_count;
+	bool as_float4;
+	bool verify;
+	const char* function;
+	const char* distribution;
+} KBenchOptions;
+
+// One array to cluster: the generated values, and the same values sorted
+typedef struct
+{
+	const char* distribution;
+	double* values;
+	double* sorted;
+	// values rounded to float4, for -4
+	float4* values4;
+	int count;
+} KBenchInput;
+
+// Exit status, 1 once a row misses its latency target
+static int kbench_status = 0;
+
+/// <summary>
+/// Standard normal, Box-Muller
+/// </summary>
+static double kbench_normal(KRandom* rng)
+{
+	double u = 1.0 - krandom_unit(rng);
+	double v = krandom_unit(rng);
+	return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+}
+
+/// <summary>
+/// count values of the named distribution, see the top of this file
+/// </summary>
+static void kbench_generate(const char* distribution, double* values, int count)
+{
+	KRandom rng;
+	krandom_seed(&rng, KBENCH_SEED, 0);
+
+	for (int i = 0; i < count; i++)
+	{
+		if (strcmp(distribution, "uniform") == 0)
+			values[i] = krandom_unit(&rng) * 1000.0;
+		else if (strcmp(distribution, "bimodal") == 0)
+			values[i] = krandom_unit(&rng) < 0.7 ? 100.0 + 10.0 * kbench_normal(&rng) : 300.0 + 20.0 * kbench_normal(&rng);
+		else if (strcmp(distribution, "sine672") == 0)
+		{
+			// Quadrant index in the week, 96 per day
+			int q = i % 672;
+			values[i] = 500.0 + 300.0 * sin(2.0 * M_PI * q / 96.0) + 100.0 * sin(2.0 * M_PI * q / 672.0) + 15.0 * kbench_normal(&rng);
+		}
+		else
+		{
+			// Milliseconds: most around 20, the tail from 200 up with no upper bound worth speaking of
+			if (krandom_unit(&rng) < 0.01)
+				values[i] = 200.0 / pow(1.0 - krandom_unit(&rng), 1.0 / 1.5);
+			else
+				values[i] = exp(3.0 + 0.5 * kbench_normal(&rng));
+		}
+	}
+}
+
+static double kbench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/// <summary>
+/// One call of function on input, in a context of its own like one SQL call. kplusplus reads the
+/// generated values as float8[] input would be, or as float4[] input with -4. ksimple and kbig take them in array order as
+/// their SQL functions do, kdynamic and getkindices expect sorted points.
+/// </summary>
+/// <param name="score">set to the score of the clusters returned, NAN when the function returns none</param>
+/// <returns>nanoseconds taken by the call</returns>
+static double kbench_call(const char* function, KBenchInput* input, int k, KBenchOptions* options, double* score)
+{
+	MemoryContext run = AllocSetContextCreate(TopMemoryContext, "kbench call", ALLOCSET_DEFAULT_SIZES);
+	MemoryContext old = MemoryContextSwitchTo(run);
+
+	Cluster* result = NULL;
+	double start = kbench_now();
+	if (strcmp(function, "kplusplus") == 0)
+		result = internal_kplusplus(options->as_float4 ? kvalues_f4(input->values4) : kvalues_f8(input->values), input->count, k, options->seeds, options->updates, KBENCH_SEED);
+	else if (strcmp(function, "ksimple") == 0)
+		result = internal_ksimple(input->values, input->count, k);
+	else if (strcmp(function, "kdynamic") == 0)
+		result = internal_kdynamic(input->sorted, input->count, KBENCH_DYNAMIC_PERC);
+	else if (strcmp(function, "kbig") == 0)
+		kbig(input->values, input->count, k - 1);
+	else
+		getKIndices(input->sorted, input->count, KBENCH_DYNAMIC_PERC, 2);
+	double elapsed = kbench_now() - start;
+
+	*score = result != NULL ? score_accum(result->accum, result->k) : NAN;
+
+	MemoryContextSwitchTo(old);
+	MemoryContextDelete(run);
+	return elapsed;
+}
+
+/// <summary>
+/// Time function on input for one k, and print its row
+/// </summary>
+static void kbench_case(const char* function, KBenchInput* input, int k, KBenchOptions* options)
+{
+	int runs = KBENCH_POINTS / input->count;
+	if (runs < options->runs)
+		runs = options->runs;
+
+	KInstrumentation before = kinstrumentation;
+	Size peak = 0;
+	double total = 0.0;
+	double score = NAN;
+	for (int r = 0; r < runs; r++)
+	{
+		Size in_use = kshim_memory_in_use();
+		kshim_reset_peak();
+		total += kbench_call(function, input, k, options, &score);
+		if (kshim_memory_peak() - in_use > peak)
+			peak = kshim_memory_peak() - in_use;
+	}
+
+	printf("%s,%s,%d,%d,%d,%d,%.0f,%.3f,%.1f,%.1f,%zu,", function, input->distribution, input->count, k, kplusplus_threads, runs,
+		total / runs, total / runs / input->count,
+		(double)(kinstrumentation.iterations - before.iterations) / runs,
+		(double)(kinstrumentation.restarts - before.restarts) / runs,
+		peak);
+	if (!isnan(score))
+		printf("%.9g", score);
+	printf("\n");
+	fflush(stdout);
+
+	if (strcmp(function, "kplusplus") == 0 && input->count == 672 && k <= 3
+		&& options->seeds <= 10 && options->updates <= 50 && total / runs > KBENCH_TARGET_672_NS)
+	{
+		fprintf(stderr, "kbench: kplusplus %s 672 k=%d took %.0f ns per call, over the target of %d ns\n",
+			input->distribution, k, total / runs, KBENCH_TARGET_672_NS);
+		kbench_status = 1;
+	}
+}
+
+/// <summary>
+/// Every function on input, for k from 2 to max_k where the function takes one, with each -t thread count
+/// </summary>
+static void kbench_input(KBenchInput* input, KBenchOptions* options)
+{
+	static const char* functions[] = { "kplusplus", "ksimple", "kbig", "kdynamic", "getkindices" };
+
+	for (size_t f = 0; f < sizeof(functions) / sizeof(functions[0]); f++)
+	{
+		if (options->function != NULL && strcmp(options->function, functions[f]) != 0)
+			continue;
+
+		for (int t = 0; t < options->thread_count; t++)
+		{
+			kplusplus_threads = options->threads[t];
+
+			// kdynamic and getKIndices settle on their own number of clusters
+			if (strcmp(functions[f], "kdynamic") == 0 || strcmp(functions[f], "getkindices") == 0)
+			{
+				kbench_case(functions[f], input, 0, options);
+				continue;
+			}
+			for (int k = 2; k <= options->max_k && k <= input->count; k++)
+				kbench_case(functions[f], input, k, options);
+		}
+	}
+}
+
+/// <summary>
+/// -V input of small integers from -8 to 8, with every 11th value -0: centroids drawn from it repeat, points
+/// halfway between two centroids tie, and adjacency_count() meets zeros of both signs
+/// </summary>
+static void kbench_generate_ties(double* values, int count)
+{
+	KRandom rng;
+	krandom_seed(&rng, KBENCH_SEED, 1);
+
+	for (int i = 0; i < count; i++)
+		values[i] = i % 11 == 0 ? -0.0 : (double)((int)(krandom_unit(&rng) * 17.0) - 8);
+}
+
+/// <summary>
+/// The kernels of simd against scalar on the first count points of values. nearest() runs with k centroids drawn
+/// from the points, d2_round() three rounds from mindist where every 5th lane starts at zero weight, as a point
+/// already chosen has, and every 5th at DBL_MAX. Results must be bit-identical.
+/// </summary>
+/// <returns>number of kernel calls whose results differ</returns>
+static int kbench_verify_kernels(KSimdKernels* simd, KSimdKernels* scalar, const char* name, double* values, float4* values4,
+	int count, int total)
+{
+	static const double thresholds[] = { 0.0, 0.01, 0.5, 2.0 };
+	double centroids[KBENCH_VERIFY_MAX_K];
+	int failures = 0;
+
+	int32* labels = palloc(sizeof(int32) * (count + 1));
+	int32* expected_labels = palloc(sizeof(int32) * (count + 1));
+	double* mindist = palloc(sizeof(double) * (count + 1));
+	double* cdf = palloc(sizeof(double) * (count + 1));
+	double* expected_mindist = palloc(sizeof(double) * (count + 1));
+	double* expected_cdf = palloc(sizeof(double) * (count + 1));
+
+	for (int k = 1; k <= KBENCH_VERIFY_MAX_K; k++)
+	{
+		for (int j = 0; j < k; j++)
+			centroids[j] = values[(int)(((int64)j * 7919) % total)];
+
+		for (int b = 0; b < count; b += KSIMD_BLOCK)
+		{
+			int n = count - b < KSIMD_BLOCK ? count - b : KSIMD_BLOCK;
+			simd->nearest(values + b, n, centroids, k, labels + b);
+			scalar->nearest(values + b, n, centroids, k, expected_labels + b);
+		}
+		if (memcmp(labels, expected_labels, sizeof(int32) * count) != 0)
+		{
+			fprintf(stderr, "kbench: %s nearest differs on %s, %d points, k=%d\n", ksimd_level_name(simd->level), name, count, k);
+			failures++;
+		}
+	}
+
+	for (int f4 = 0; f4 <= 1; f4++)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			double d = values[i] - values[count / 3];
+			mindist[i] = i % 5 == 0 ? 0.0 : i % 5 == 1 ? DBL_MAX : d * d;
+		}
+		memcpy(expected_mindist, mindist, sizeof(double) * count);
+
+		// The first round's newest is a point itself, so its lane drops to zero weight too
+		double newest[3] = { values[0], values[count / 2], values[count > 0 ? count - 1 : 0] + 0.5 };
+		for (int round = 0; round < 3 && count > 0; round++)
+		{
+			double got, expected;
+			if (f4)
+			{
+				got = simd->d2_round_f4(values4, count, newest[round], mindist, cdf);
+				expected = scalar->d2_round_f4(values4, count, newest[round], expected_mindist, expected_cdf);
+			}
+			else
+			{
+				got = simd->d2_round_f8(values, count, newest[round], mindist, cdf);
+				expected = scalar->d2_round_f8(values, count, newest[round], expected_mindist, expected_cdf);
+			}
+			if (memcmp(&got, &expected, sizeof(double)) != 0
+				|| memcmp(mindist, expected_mindist, sizeof(double) * count) != 0
+				|| memcmp(cdf, expected_cdf, sizeof(double) * count) != 0)
+			{
+				fprintf(stderr, "kbench: %s d2_round_%s differs on %s, %d points, round %d\n", ksimd_level_name(simd->level),
+					f4 ? "f4" : "f8", name, count, round);
+				failures++;
+			}
+		}
+	}
+
+	for (size_t t = 0; t < sizeof(thresholds) / sizeof(thresholds[0]); t++)
+	{
+		if (simd->adjacency_count(values, count, thresholds[t]) != scalar->adjacency_count(values, count, thresholds[t]))
+		{
+			fprintf(stderr, "kbench: %s adjacency_count differs on %s, %d points, threshold %g\n", ksimd_level_name(simd->level),
+				name, count, thresholds[t]);
+			failures++;
+		}
+	}
+
+	pfree(expected_cdf);
+	pfree(expected_mindist);
+	pfree(cdf);
+	pfree(mindist);
+	pfree(expected_labels);
+	pfree(labels);
+	return failures;
+}
+
+/// <summary>
+/// Bitwise equality of two clusters' totals, field by field to skip the padding after count
+/// </summary>
+static bool kbench_same_accum(ClusterAccum* a, ClusterAccum* b, int k)
+{
+	for (int j = 0; j < k; j++)
+	{
+		if (a[j].count != b[j].count
+			|| memcmp(&a[j].mean, &b[j].mean, sizeof(double)) != 0
+			|| memcmp(&a[j].m2, &b[j].m2, sizeof(double)) != 0
+			|| memcmp(&a[j].min, &b[j].min, sizeof(double)) != 0
+			|| memcmp(&a[j].max, &b[j].max, sizeof(double)) != 0)
+			return false;
+	}
+	return true;
+}
+
+/// <summary>
+/// Copy of the labels and totals of one internal_kplusplus() or internal_ksimple() call at the simd level in use
+/// </summary>
+static Cluster kbench_verify_call(const char* function, double* values, float4* values4, int count, int k)
+{
+	MemoryContext run = AllocSetContextCreate(TopMemoryContext, "kbench verify", ALLOCSET_DEFAULT_SIZES);
+	MemoryContext old = MemoryContextSwitchTo(run);
+
+	Cluster* result;
+	if (strcmp(function, "ksimple") == 0)
+		result = internal_ksimple(values, count, k);
+	else
+		result = internal_kplusplus(values4 != NULL ? kvalues_f4(values4) : kvalues_f8(values), count, k, 10, 50, KBENCH_SEED);
+
+	MemoryContextSwitchTo(old);
+	Cluster copy = *result;
+	copy.accum = palloc(sizeof(ClusterAccum) * result->k);
+	memcpy(copy.accum, result->accum, sizeof(ClusterAccum) * result->k);
+	copy.labels.data = palloc(result->labels.size * (Size)result->count);
+	memcpy(copy.labels.data, result->labels.data, result->labels.size * (Size)result->count);
+	MemoryContextDelete(run);
+	return copy;
+}
+
+/// <summary>
+/// -V: every SIMD kernel the CPU has against the scalar reference, on the four distributions and an array of ties.
+/// Each kernel runs on every prefix up to KBENCH_VERIFY_TAILS points and on the whole array, then whole ksimple
+/// and kplusplus calls (float8 and float4, Lloyd's iteration over every point and mini-batch) must return the
+/// same labels and totals as with scalar kernels.
+/// </summary>
+/// <returns>exit status, 1 when anything differs</returns>
+static int kbench_verify(void)
+{
+	static const KSimdLevel levels[] = { KSIMD_SSE2, KSIMD_AVX2, KSIMD_AVX512, KSIMD_NEON };
+	static const char* functions[] = { "ksimple", "kplusplus", "kplusplus float4", "kplusplus mini-batch" };
+
+	int count = KBENCH_VERIFY_POINTS;
+	double* values[KBENCH_DISTRIBUTIONS + 1];
+	float4* values4[KBENCH_DISTRIBUTIONS + 1];
+	const char* names[KBENCH_DISTRIBUTIONS + 1];
+	for (size_t d = 0; d <= KBENCH_DISTRIBUTIONS; d++)
+	{
+		values[d] = palloc(sizeof(double) * count);
+		values4[d] = palloc(sizeof(float4) * count);
+		if (d < KBENCH_DISTRIBUTIONS)
+		{
+			names[d] = kbench_distributions[d];
+			kbench_generate(names[d], values[d], count);
+		}
+		else
+		{
+			names[d] = "ties";
+			kbench_generate_ties(values[d], count);
+		}
+		for (int i = 0; i < count; i++)
+			values4[d][i] = (float4)values[d][i];
+	}
+
+	int saved_bounded = kplusplus_bounded_threshold;
+	int saved_batch = kplusplus_batch_size;
+	int failures = 0;
+	for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++)
+	{
+		ksimd_select(KSIMD_SCALAR);
+		KSimdKernels scalar = ksimd;
+		ksimd_select(levels[l]);
+		KSimdKernels simd = ksimd;
+		if (simd.level != levels[l])
+		{
+			printf("%s: not available\n", ksimd_level_name(levels[l]));
+			continue;
+		}
+
+		int level_failures = 0;
+		for (size_t d = 0; d <= KBENCH_DISTRIBUTIONS; d++)
+		{
+			for (int n = 0; n <= KBENCH_VERIFY_TAILS; n++)
+				level_failures += kbench_verify_kernels(&simd, &scalar, names[d], values[d], values4[d], n, count);
+			level_failures += kbench_verify_kernels(&simd, &scalar, names[d], values[d], values4[d], count, count);
+
+			// Every restart reassigns every point, through nearest(), instead of moving boundaries
+			kplusplus_bounded_threshold = -1;
+			for (size_t f = 0; f < sizeof(functions) / sizeof(functions[0]); f++)
+			{
+				kplusplus_batch_size = strcmp(functions[f], "kplusplus mini-batch") == 0 ? 1024 : 0;
+				bool f4 = strcmp(functions[f], "kplusplus float4") == 0;
+				for (int k = 2; k <= 8; k++)
+				{
+					ksimd = scalar;
+					Cluster expected = kbench_verify_call(functions[f], values[d], f4 ? values4[d] : NULL, count, k);
+					ksimd = simd;
+					Cluster got = kbench_verify_call(functions[f], values[d], f4 ? values4[d] : NULL, count, k);
+
+					if (got.k != expected.k || got.count != expected.count || got.labels.size != expected.labels.size
+						|| memcmp(got.labels.data, expected.labels.data, got.labels.size * (Size)got.count) != 0
+						|| !kbench_same_accum(got.accum, expected.accum, got.k))
+					{
+						fprintf(stderr, "kbench: %s %s differs on %s, k=%d\n", ksimd_level_name(simd.level), functions[f], names[d], k);
+						level_failures++;
+					}
+					pfree(got.labels.data);
+					pfree(got.accum);
+					pfree(expected.labels.data);
+					pfree(expected.accum);
+				}
+			}
+			kplusplus_bounded_threshold = saved_bounded;
+			kplusplus_batch_size = saved_batch;
+		}
+		printf("%s: %s\n", ksimd_level_name(simd.level), level_failures == 0 ? "identical to scalar" : "DIFFERS");
+		failures += level_failures;
+	}
+
+	ksimd_select(kplusplus_simd);
+	return failures == 0 ? 0 : 1;
+}
+
+static void kbench_usage(void)
+{
+	fprintf(stderr, "usage: kbench [-n max_points] [-r runs] [-k max_k] [-s seeds] [-u updates] [-t threads[,threads...]] [-m simd]\n"
+		"              [-S sample_threshold] [-b batch_size] [-P parallel_threshold] [-B bounded_threshold] [-L small_limit] [-4]\n"
+		"              [-f function] [-d distribution] [-V]\n"
+		"  functions: kplusplus ksimple kbig kdynamic getkindices\n"
+		"  distributions: uniform bimodal sine672 latency\n"
+		"  simd: auto scalar sse2 avx2 avx512 neon\n");
+	exit(2);
+}
+
+int main(int argc, char** argv)
+{
+	kshim_init();
+	_PG_init();
+
+	KBenchOptions options;
+	options.max_points = 10000000;
+	options.runs = 3;
+	options.max_k = 5;
+	options.seeds = 10;
+	options.updates = 50;
+	options.threads[0] = kplusplus_threads;
+	options.thread_count = 1;
+	options.as_float4 = false;
+	options.verify = false;
+	options.function = NULL;
+	options.distribution = NULL;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:r:k:s:u:t:m:S:b:P:B:L:4f:d:V")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			options.max_points = atoi(optarg);
+			break;
+		case 'r':
+			options.runs = atoi(optarg);
+			break;
+		case 'k':
+			options.max_k = atoi(optarg);
+			break;
+		case 's':
+			options.seeds = atoi(optarg);
+			break;
+		case 'u':
+			options.updates = atoi(optarg);
+			break;
+		case 't':
+		{
+			char* list = optarg;
+			options.thread_count = 0;
+			while (*list != '\0')
+			{
+				char* end;
+				long threads = strtol(list, &end, 10);
+				if (end == list || threads < 1 || threads > KPOOL_MAX_THREADS || options.thread_count == KPOOL_MAX_THREADS)
+					kbench_usage();
+				if (*end != ',' && *end != '\0')
+					kbench_usage();
+				options.threads[options.thread_count++] = (int)threads;
+				list = *end == ',' ? end + 1 : end;
+			}
+			if (options.thread_count == 0)
+				kbench_usage();
+			break;
+		}
+		case 'm':
+		{
+			const struct config_enum_entry* e = ksimd_options;
+			while (e->name != NULL && strcmp(e->name, optarg) != 0)
+				e++;
+			if (e->name == NULL)
+				kbench_usage();
+			kplusplus_simd = e->val;
+			ksimd_select(kplusplus_simd);
+			break;
+		}
+		case 'S':
+			kplusplus_sample_threshold = atoi(optarg);
+			break;
+		case 'b':
+			kplusplus_batch_size = atoi(optarg);
+			if (kplusplus_batch_size < 0)
+				kbench_usage();
+			break;
+		case 'P':
+			kplusplus_parallel_threshold = atoi(optarg);
+			if (kplusplus_parallel_threshold < -1)
+				kbench_usage();
+			break;
+		case 'B':
+			kplusplus_bounded_threshold = atoi(optarg);
+			if (kplusplus_bounded_threshold < -1)
+				kbench_usage();
+			break;
+		case 'L':
+			kplusplus_small_limit = atoi(optarg);
+			if (kplusplus_small_limit < 0)
+				kbench_usage();
+			break;
+		case '4':
+			options.as_float4 = true;
+			break;
+		case 'V':
+			options.verify = true;
+			break;
+		case 'f':
+			options.function = optarg;
+			break;
+		case 'd':
+			options.distribution = optarg;
+			break;
+		default:
+			kbench_usage();
+		}
+	}
+	if (options.runs < 1 || options.max_k < 2 || options.seeds < 1 || options.updates < 1)
+		kbench_usage();
+
+	if (options.verify)
+		return kbench_verify();
+
+	printf("function,distribution,n,k,threads,runs,ns_per_call,ns_per_point,iterations,restarts,peak_memory,score\n");
+
+	for (size_t d = 0; d < KBENCH_DISTRIBUTIONS; d++)
+	{
+		if (options.distribution != NULL && strcmp(options.distribution, kbench_distributions[d]) != 0)
+			continue;
+
+		for (size_t l = 0; l < KBENCH_LENGTHS && kbench_lengths[l] <= options.max_points; l++)
+		{
+			KBenchInput input;
+			input.distribution = kbench_distributions[d];
+			input.count = kbench_lengths[l];
+			input.values = palloc(sizeof(double) * input.count);
+			kbench_generate(input.distribution, input.values, input.count);
+			input.sorted = palloc(sizeof(double) * input.count);
+			memcpy(input.sorted, input.values, sizeof(double) * input.count);
+			sort_doubles(input.sorted, input.count);
+			input.values4 = palloc(sizeof(float4) * input.count);
+			for (int i = 0; i < input.count; i++)
+				input.values4[i] = (float4)input.values[i];
+
+			kbench_input(&input, &options);
+
+			pfree(input.values4);
+			pfree(input.sorted);
+			pfree(input.values);
+		}
+	}
+	return kbench_status;
+}
@@ -0,0 +1,499 @@
+#include "kshim.h"
+#include "kshared.h"
+#include "access/htup_details.h"
+#include "utils/hsearch.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+
+/**
+* Backend replacements for bench/kbench, see kshim.h
+*
+* Written against the PostgreSQL 14 server headers, with guards for later majors where they differ: the kernels are compiled exactly as for the server,
+* only the definitions behind palloc(), ereport() and friends are these.
+* Without libpgport the port.h printf and qsort replacements are not linked, so the libc ones are used here.
+*/
+#undef vsnprintf
+#undef fprintf
+#undef qsort
+
+// Every palloc() chunk starts with this header. context is last, just before the data, where the
+// PG14 and PG15 GetMemoryChunkContext() looks for it. PG16 headers encode chunk headers differently,
+// but nothing linked into kbench reads them: pfree() and repalloc() below take the context from here.
+typedef struct KShimChunk
+{
+	struct KShimChunk* prev;
+	struct KShimChunk* next;
+	Size size;
+	MemoryContext context;
+} KShimChunk;
+
+// A memory context: its chunks in a list, so deleting it frees them all
+typedef struct
+{
+	MemoryContextData header;
+	KShimChunk* chunks;
+} KShimContext;
+
+MemoryContext CurrentMemoryContext = NULL;
+MemoryContext TopMemoryContext = NULL;
+
+static Size kshim_in_use = 0;
+static Size kshim_peak = 0;
+
+// The ereport() in progress
+static int kshim_elevel;
+static int kshim_sqlerrcode;
+static char kshim_message[1024];
+
+/// <summary>
+/// Create TopMemoryContext and make it current
+/// </summary>
+void kshim_init(void)
+{
+	TopMemoryContext = AllocSetContextCreate((MemoryContext)NULL, "TopMemoryContext", ALLOCSET_DEFAULT_SIZES);
+	CurrentMemoryContext = TopMemoryContext;
+}
+
+Size kshim_memory_in_use(void)
+{
+	return kshim_in_use;
+}
+
+Size kshim_memory_peak(void)
+{
+	return kshim_peak;
+}
+
+void kshim_reset_peak(void)
+{
+	kshim_peak = kshim_in_use;
+}
+
+/// <summary>
+/// Abort on a backend function only the SQL interface uses
+/// </summary>
+static void kshim_unsupported(const char* name)
+{
+	fprintf(stderr, "kbench: %s is not available outside a server\n", name);
+	abort();
+}
+
+//
+// Memory contexts
+//
+
+static void* kshim_alloc(MemoryContext context, Size size, bool zero)
+{
+	KShimChunk* chunk = zero ? calloc(1, sizeof(KShimChunk) + size) : malloc(sizeof(KShimChunk) + size);
+	if (chunk == NULL)
+		ereport(ERROR, errcode(ERRCODE_OUT_OF_MEMORY), errmsg("out of memory, failed on request of size %zu", size));
+
+	KShimContext* owner = (KShimContext*)context;
+	chunk->prev = NULL;
+	chunk->next = owner->chunks;
+	if (owner->chunks != NULL)
+		owner->chunks->prev = chunk;
+	owner->chunks = chunk;
+	chunk->size = size;
+	chunk->context = context;
+
+	context->mem_allocated += size;
+	kshim_in_use += size;
+	if (kshim_in_use > kshim_peak)
+		kshim_peak = kshim_in_use;
+
+	return chunk + 1;
+}
+
+static KShimChunk* kshim_unlink(void* pointer)
+{
+	KShimChunk* chunk = (KShimChunk*)pointer - 1;
+	KShimContext* owner = (KShimContext*)chunk->context;
+
+	if (chunk->prev != NULL)
+		chunk->prev->next = chunk->next;
+	else
+		owner->chunks = chunk->next;
+	if (chunk->next != NULL)
+		chunk->next->prev = chunk->prev;
+
+	chunk->context->mem_allocated -= chunk->size;
+	kshim_in_use -= chunk->size;
+	return chunk;
+}
+
+void* MemoryContextAlloc(MemoryContext context, Size size)
+{
+	return kshim_alloc(context, size, false);
+}
+
+void* MemoryContextAllocZero(MemoryContext context, Size size)
+{
+	return kshim_alloc(context, size, true);
+}
+
+#if PG_VERSION_NUM < 160000
+// palloc0fast() calls this up to PG15
+void* MemoryContextAllocZeroAligned(MemoryContext context, Size size)
+{
+	return kshim_alloc(context, size, true);
+}
+#endif
+
+void* MemoryContextAllocExtended(MemoryContext context, Size size, int flags)
+{
+	return kshim_alloc(context, size, (flags & MCXT_ALLOC_ZERO) != 0);
+}
+
+void* MemoryContextAllocHuge(MemoryContext context, Size size)
+{
+	return kshim_alloc(context, size, false);
+}
+
+void* palloc(Size size)
+{
+	return kshim_alloc(CurrentMemoryContext, size, false);
+}
+
+void* palloc0(Size size)
+{
+	return kshim_alloc(CurrentMemoryContext, size, true);
+}
+
+void* palloc_extended(Size size, int flags)
+{
+	return kshim_alloc(CurrentMemoryContext, size, (flags & MCXT_ALLOC_ZERO) != 0);
+}
+
+void pfree(void* pointer)
+{
+	free(kshim_unlink(pointer));
+}
+
+void* repalloc(void* pointer, Size size)
+{
+	MemoryContext context = ((KShimChunk*)pointer - 1)->context;
+	Size old = ((KShimChunk*)pointer - 1)->size;
+
+	void* moved = kshim_alloc(context, size, false);
+	memcpy(moved, pointer, old < size ? old : size);
+	pfree(pointer);
+	return moved;
+}
+
+void* repalloc_huge(void* pointer, Size size)
+{
+	return repalloc(pointer, size);
+}
+
+/// <summary>
+/// A context under parent. The size hints are ignored, chunks are allocated one by one
+/// </summary>
+MemoryContext AllocSetContextCreateInternal(MemoryContext parent, const char* name, Size minContextSize, Size initBlockSize, Size maxBlockSize)
+{
+	KShimContext* owner = calloc(1, sizeof(KShimContext));
+	if (owner == NULL)
+		ereport(ERROR, errcode(ERRCODE_OUT_OF_MEMORY), errmsg("out of memory, failed to create context %s", name));
+
+	MemoryContext context = &owner->header;
+	context->type = T_AllocSetContext;
+	context->name = name;
+	context->parent = parent;
+	if (parent != NULL)
+	{
+		context->nextchild = parent->firstchild;
+		if (parent->firstchild != NULL)
+			parent->firstchild->prevchild = context;
+		parent->firstchild = context;
+	}
+	return context;
+}
+
+/// <summary>
+/// Free every chunk of context, and delete its children
+/// </summary>
+void MemoryContextReset(MemoryContext context)
+{
+	while (context->firstchild != NULL)
+		MemoryContextDelete(context->firstchild);
+
+	KShimContext* owner = (KShimContext*)context;
+	while (owner->chunks != NULL)
+		free(kshim_unlink(owner->chunks + 1));
+}
+
+void MemoryContextDelete(MemoryContext context)
+{
+	MemoryContextReset(context);
+
+	MemoryContext parent = context->parent;
+	if (parent != NULL)
+	{
+		if (context->prevchild != NULL)
+			context->prevchild->nextchild = context->nextchild;
+		else
+			parent->firstchild = context->nextchild;
+		if (context->nextchild != NULL)
+			context->nextchild->prevchild = context->prevchild;
+	}
+	if (CurrentMemoryContext == context)
+		CurrentMemoryContext = parent;
+	free(context);
+}
+
+/// <summary>
+/// Bytes palloc()'d in context, and in its children if recurse. A server also counts the unused
+/// part of its blocks, so this is a lower bound of what the same call takes in a backend.
+/// </summary>
+Size MemoryContextMemAllocated(MemoryContext context, bool recurse)
+{
+	Size total = context->mem_allocated;
+	if (recurse)
+	{
+		for (MemoryContext child = context->firstchild; child != NULL; child = child->nextchild)
+			total += MemoryContextMemAllocated(child, true);
+	}
+	return total;
+}
+
+//
+// Errors: printed to stderr, ERROR and above exit
+//
+
+bool errstart(int elevel, const char* domain)
+{
+	kshim_elevel = elevel;
+	kshim_sqlerrcode = 0;
+	kshim_message[0] = '\0';
+	return elevel >= WARNING;
+}
+
+bool errstart_cold(int elevel, const char* domain)
+{
+	return errstart(elevel, domain);
+}
+
+int errcode(int sqlerrcode)
+{
+	kshim_sqlerrcode = sqlerrcode;
+	return 0;
+}
+
+int errmsg(const char* fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(kshim_message, sizeof(kshim_message), fmt, args);
+	va_end(args);
+	return 0;
+}
+
+int errmsg_internal(const char* fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(kshim_message, sizeof(kshim_message), fmt, args);
+	va_end(args);
+	return 0;
+}
+
+/// <summary>
+/// The five character SQLSTATE of an errcode()
+/// </summary>
+static const char* kshim_sqlstate(int sqlerrcode)
+{
+	static char buf[6];
+	for (int i = 0; i < 5; i++)
+	{
+		buf[i] = PGUNSIXBIT(sqlerrcode);
+		sqlerrcode >>= 6;
+	}
+	buf[5] = '\0';
+	return buf;
+}
+
+void errfinish(const char* filename, int lineno, const char* funcname)
+{
+	fprintf(stderr, "kbench: %s: %s (%s:%d %s, sqlstate %s)\n", kshim_elevel >= ERROR ? "ERROR" : "WARNING",
+		kshim_message, filename, lineno, funcname != NULL ? funcname : "", kshim_sqlstate(kshim_sqlerrcode));
+	if (kshim_elevel >= ERROR)
+		exit(1);
+}
+
+//
+// Port and utility functions
+//
+
+void pg_qsort(void* base, size_t nel, size_t elsize, int (*cmp)(const void*, const void*))
+{
+	qsort(base, nel, elsize, cmp);
+}
+
+bool pg_strong_random(void* buf, size_t len)
+{
+	FILE* f = fopen("/dev/urandom", "rb");
+	if (f == NULL)
+		return false;
+	bool ok = fread(buf, 1, len, f) == len;
+	fclose(f);
+	return ok;
+}
+
+TimestampTz GetCurrentTimestamp(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (TimestampTz)ts.tv_sec * USECS_PER_SEC + ts.tv_nsec / 1000
+		- (TimestampTz)(POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * SECS_PER_DAY * USECS_PER_SEC;
+}
+
+//
+// GUCs: _PG_init() sets every setting to its default
+//
+
+void DefineCustomIntVariable(const char* name, const char* short_desc, const char* long_desc, int* valueAddr,
+	int bootValue, int minValue, int maxValue, GucContext context, int flags,
+	GucIntCheckHook check_hook, GucIntAssignHook assign_hook, GucShowHook show_hook)
+{
+	*valueAddr = bootValue;
+	if (assign_hook != NULL)
+		assign_hook(bootValue, NULL);
+}
+
+void DefineCustomEnumVariable(const char* name, const char* short_desc, const char* long_desc, int* valueAddr,
+	int bootValue, const struct config_enum_entry* options, GucContext context, int flags,
+	GucEnumCheckHook check_hook, GucEnumAssignHook assign_hook, GucShowHook show_hook)
+{
+	*valueAddr = bootValue;
+	if (assign_hook != NULL)
+		assign_hook(bootValue, NULL);
+}
+
+//
+// Shared result cache (kshared.c): there is no postmaster, so it is never enabled
+//
+
+int kplusplus_shared_cache_size = 0;
+int kplusplus_shared_cache_ttl = 0;
+
+void kshared_init(void)
+{
+}
+
+bool kshared_enabled(void)
+{
+	return false;
+}
+
+ClusterStats* kshared_lookup(KCacheTag* tag, ArrayType* arr)
+{
+	kshim_unsupported("kshared_lookup");
+	return NULL;
+}
+
+bool kshared_store(KCacheTag* tag, ArrayType* arr, ClusterStats* stats, const char* series)
+{
+	kshim_unsupported("kshared_store");
+	return false;
+}
+
+//
+// SQL interface only
+//
+
+struct varlena* pg_detoast_datum(struct varlena* datum)
+{
+	kshim_unsupported("pg_detoast_datum");
+	return NULL;
+}
+
+TypeFuncClass get_call_result_type(FunctionCallInfo fcinfo, Oid* resultTypeId, TupleDesc* resultTupleDesc)
+{
+	kshim_unsupported("get_call_result_type");
+	return TYPEFUNC_OTHER;
+}
+
+TupleDesc BlessTupleDesc(TupleDesc tupdesc)
+{
+	kshim_unsupported("BlessTupleDesc");
+	return NULL;
+}
+
+HeapTuple heap_form_tuple(TupleDesc tupleDescriptor, Datum* values, bool* isnull)
+{
+	kshim_unsupported("heap_form_tuple");
+	return NULL;
+}
+
+Datum HeapTupleHeaderGetDatum(HeapTupleHeader tuple)
+{
+	kshim_unsupported("HeapTupleHeaderGetDatum");
+	return (Datum)0;
+}
+
+FuncCallContext* init_MultiFuncCall(PG_FUNCTION_ARGS)
+{
+	kshim_unsupported("init_MultiFuncCall");
+	return NULL;
+}
+
+FuncCallContext* per_MultiFuncCall(PG_FUNCTION_ARGS)
+{
+	kshim_unsupported("per_MultiFuncCall");
+	return NULL;
+}
+
+void end_MultiFuncCall(PG_FUNCTION_ARGS, FuncCallContext* funcctx)
+{
+	kshim_unsupported("end_MultiFuncCall");
+}
+
+ArrayType* construct_array(Datum* elems, int nelems, Oid elmtype, int elmlen, bool elmbyval, char elmalign)
+{
+	kshim_unsupported("construct_array");
+	return NULL;
+}
+
+void get_typlenbyvalalign(Oid typid, int16* typlen, bool* typbyval, char* typalign)
+{
+	kshim_unsupported("get_typlenbyvalalign");
+}
+
+text* cstring_to_text(const char* s)
+{
+	kshim_unsupported("cstring_to_text");
+	return NULL;
+}
+
+int work_mem = 4096;
+
+Tuplestorestate* tuplestore_begin_heap(bool randomAccess, bool interXact, int maxKBytes)
+{
+	kshim_unsupported("tuplestore_begin_heap");
+	return NULL;
+}
+
+void tuplestore_putvalues(Tuplestorestate* state, TupleDesc tdesc, Datum* values, bool* isnull)
+{
+	kshim_unsupported("tuplestore_putvalues");
+}
+
+HTAB* hash_create(const char* tabname, long nelem, const HASHCTL* info, int flags)
+{
+	kshim_unsupported("hash_create");
+	return NULL;
+}
+
+void* hash_search(HTAB* hashp, const void* keyPtr, HASHACTION action, bool* foundPtr)
+{
+	kshim_unsupported("hash_search");
+	return NULL;
+}
+
+long hash_get_num_entries(HTAB* hashp)
+{
+	kshim_unsupported("hash_get_num_entries");
+	return 0;
+}
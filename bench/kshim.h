@@ -0,0 +1,21 @@
+#pragma once
+
+#include "timecache.h"
+
+/**
+* The few backend services the clustering kernels use, for running them outside a server
+*
+* Implemented in kshim.c against the server headers: memory contexts over malloc, ereport() to stderr
+* (exiting on ERROR), random seeds and the GUC definitions of _PG_init(). The SQL interface functions
+* are linked in with the kernels but abort if they are ever called.
+*/
+
+// Create the top memory context, call once before any kernel
+void kshim_init(void);
+
+// Bytes allocated by palloc() and not yet freed, over every context
+Size kshim_memory_in_use(void);
+
+// Highest kshim_memory_in_use() since kshim_reset_peak()
+Size kshim_memory_peak(void);
+void kshim_reset_peak(void);
@@ -0,0 +1,8 @@
+-- biggest_breaks(points, k): indices of the k - 1 largest gaps
+-- lateral=0: one series per transaction, lateral=1: 100 series per transaction in a lateral join (see bench/run.sh)
+\set id random(1, :series - 99)
+\if :lateral
+SELECT count(biggest_breaks(s.sine, 3)) FROM bench_series s WHERE s.series_id BETWEEN :id AND :id + 99;
+\else
+SELECT biggest_breaks((SELECT sine FROM bench_series WHERE series_id = :id), 3);
+\endif
@@ -0,0 +1,8 @@
+-- generate_sinewave_series: one week of 15 minute points per series
+-- lateral=0: one series per transaction, lateral=1: 100 series per transaction in a lateral join (see bench/run.sh)
+\set id random(1, :series - 99)
+\if :lateral
+SELECT count(*) FROM generate_series(:id, :id + 99) s CROSS JOIN LATERAL generate_sinewave_series('2021-07-04 00:00+00', '2021-07-10 23:45+00', interval '15 minutes', 1440, 10 + s % 90) p;
+\else
+SELECT count(*) FROM generate_sinewave_series('2021-07-04 00:00+00', '2021-07-10 23:45+00', interval '15 minutes', 1440, 10 + :id % 90) p;
+\endif
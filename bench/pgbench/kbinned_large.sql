@@ -0,0 +1,8 @@
+-- kbinned_all(points, k), on 100000 point arrays
+-- lateral=0: one array per transaction, lateral=1: every bench_large array in one transaction (see bench/run.sh)
+\set id random(1, :large)
+\if :lateral
+SELECT count(*) FROM bench_large l CROSS JOIN LATERAL kbinned_all(l.points, 3) c;
+\else
+SELECT * FROM kbinned_all((SELECT points FROM bench_large WHERE id = :id), 3);
+\endif
@@ -0,0 +1,8 @@
+-- knear_avg(points, k, seeds, updates, target, min_count): average of the cluster nearest a target value
+-- lateral=0: one series per transaction, lateral=1: 100 series per transaction in a lateral join (see bench/run.sh)
+\set id random(1, :series - 99)
+\if :lateral
+SELECT count(knear_avg(s.sine, 3, 10, 50, 0.0, 10, seed => 42)) FROM bench_series s WHERE s.series_id BETWEEN :id AND :id + 99;
+\else
+SELECT knear_avg((SELECT sine FROM bench_series WHERE series_id = :id), 3, 10, 50, 0.0, 10, seed => 42);
+\endif
@@ -0,0 +1,8 @@
+-- kplusplus_agg(value, k, seeds, updates): clusters of a series from its rows
+-- lateral=0: one series per transaction, lateral=1: 100 series per transaction in a lateral join (see bench/run.sh)
+\set id random(1, :series - 99)
+\if :lateral
+SELECT s.series_id, kplusplus_agg(v, 3, 10, 50, 42) FROM bench_series s CROSS JOIN LATERAL unnest(s.sine) v WHERE s.series_id BETWEEN :id AND :id + 99 GROUP BY s.series_id;
+\else
+SELECT kplusplus_agg(v, 3, 10, 50, 42) FROM unnest((SELECT sine FROM bench_series WHERE series_id = :id)) v;
+\endif
@@ -0,0 +1,8 @@
+-- kplusplus_all(points, k, seeds, updates), on 100000 point arrays
+-- lateral=0: one array per transaction, lateral=1: every bench_large array in one transaction (see bench/run.sh)
+\set id random(1, :large)
+\if :lateral
+SELECT count(*) FROM bench_large l CROSS JOIN LATERAL kplusplus_all(l.points, 3, 10, 50, seed => 42) c;
+\else
+SELECT * FROM kplusplus_all((SELECT points FROM bench_large WHERE id = :id), 3, 10, 50, seed => 42);
+\endif
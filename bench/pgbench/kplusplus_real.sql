@@ -0,0 +1,8 @@
+-- kplusplus on real[] input, the cast included
+-- lateral=0: one series per transaction, lateral=1: 100 series per transaction in a lateral join (see bench/run.sh)
+\set id random(1, :series - 99)
+\if :lateral
+SELECT count(*) FROM bench_series s CROSS JOIN LATERAL kplusplus(s.sine::real[], 3, 10, 50, seed => 42) c WHERE s.series_id BETWEEN :id AND :id + 99;
+\else
+SELECT * FROM kplusplus((SELECT sine FROM bench_series WHERE series_id = :id)::real[], 3, 10, 50, seed => 42);
+\endif
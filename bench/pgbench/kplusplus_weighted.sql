@@ -0,0 +1,8 @@
+-- kplusplus_weighted(values, weights, k, seeds, updates): stats of the largest cluster
+-- lateral=0: one series per transaction, lateral=1: 100 series per transaction in a lateral join (see bench/run.sh)
+\set id random(1, :series - 99)
+\if :lateral
+SELECT count(*) FROM bench_series s CROSS JOIN LATERAL kplusplus_weighted(s.sine, s.weights, 3, 10, 50, seed => 42) c WHERE s.series_id BETWEEN :id AND :id + 99;
+\else
+SELECT * FROM kplusplus_weighted((SELECT sine FROM bench_series WHERE series_id = :id), (SELECT weights FROM bench_series WHERE series_id = :id), 3, 10, 50, seed => 42);
+\endif
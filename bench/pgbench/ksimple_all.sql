@@ -0,0 +1,8 @@
+-- ksimple_all(points, k): every cluster, one row each
+-- lateral=0: one series per transaction, lateral=1: 100 series per transaction in a lateral join (see bench/run.sh)
+\set id random(1, :series - 99)
+\if :lateral
+SELECT count(*) FROM bench_series s CROSS JOIN LATERAL ksimple_all(s.sine, 3) c WHERE s.series_id BETWEEN :id AND :id + 99;
+\else
+SELECT * FROM ksimple_all((SELECT sine FROM bench_series WHERE series_id = :id), 3);
+\endif
@@ -0,0 +1,8 @@
+-- ktest_adjacency_rd(points, threshold): adjacent relative differences over a threshold
+-- lateral=0: one series per transaction, lateral=1: 100 series per transaction in a lateral join (see bench/run.sh)
+\set id random(1, :series - 99)
+\if :lateral
+SELECT count(ktest_adjacency_rd(s.walk, 0.01)) FROM bench_series s WHERE s.series_id BETWEEN :id AND :id + 99;
+\else
+SELECT ktest_adjacency_rd((SELECT walk FROM bench_series WHERE series_id = :id), 0.01);
+\endif
@@ -0,0 +1,8 @@
+-- quadrants_from_points(points, indices): the five quadrants of an hourly check
+-- lateral=0: one series per transaction, lateral=1: 100 series per transaction in a lateral join (see bench/run.sh)
+\set id random(1, :series - 99)
+\if :lateral
+SELECT count(quadrants_from_points(s.sine, '{96,97,98,99,100}')) FROM bench_series s WHERE s.series_id BETWEEN :id AND :id + 99;
+\else
+SELECT quadrants_from_points((SELECT sine FROM bench_series WHERE series_id = :id), '{96,97,98,99,100}');
+\endif
@@ -0,0 +1,103 @@
+#!/bin/sh
+#
+# End-to-end SQL benchmark: every script in bench/pgbench, on a throwaway cluster, through pgbench
+#
+#   make install && bench/run.sh [script ...]
+#
+# Creates a cluster in a temporary directory, loads bench/setup.sql and runs each script twice:
+# lateral=0 (one series per transaction) and lateral=1 (100 series per transaction in a lateral join).
+# Each run appends one CSV row to $OUT and prints it:
+#
+#   label,server_version,script,lateral,series,clients,duration_s,transactions,tps,lat_avg_ms,lat_p50_ms,lat_p90_ms,lat_p99_ms,lat_max_ms
+#
+# Latency percentiles come from the pgbench transaction logs. Rows of the same label come from the same
+# source tree, compare two labels with bench/compare.sh. Settings, from the environment:
+#
+#   PG_CONFIG   pg_config of the server to run (pg_config on PATH)
+#   SERIES      bench_series rows, 100 or more (100000)
+#   LARGE       bench_large rows of 100000 points (10)
+#   CLIENTS     pgbench clients and threads (4)
+#   DURATION    seconds per run (30)
+#   PORT        port of the throwaway cluster (5499)
+#   LABEL       label of the rows (git describe of this tree)
+#   OUT         CSV file appended to (bench/results/$LABEL.csv)
+#   KEEP        1 keeps the cluster directory, its path is printed at the end
+
+set -e
+
+BENCH=$(cd "$(dirname "$0")" && pwd)
+PG_CONFIG=${PG_CONFIG:-pg_config}
+BINDIR=$("$PG_CONFIG" --bindir)
+SERIES=${SERIES:-100000}
+LARGE=${LARGE:-10}
+CLIENTS=${CLIENTS:-4}
+DURATION=${DURATION:-30}
+PORT=${PORT:-5499}
+LABEL=${LABEL:-$(git -C "$BENCH" describe --always --dirty 2>/dev/null || echo unknown)}
+OUT=${OUT:-$BENCH/results/$LABEL.csv}
+
+if [ "$SERIES" -lt 100 ]; then
+	echo "SERIES must be at least 100" >&2
+	exit 2
+fi
+
+SCRIPTS="$*"
+if [ -z "$SCRIPTS" ]; then
+	SCRIPTS=$(cd "$BENCH/pgbench" && ls *.sql | sed 's/\.sql$//')
+fi
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/timecache-bench.XXXXXX")
+DATA=$WORK/data
+
+cleanup()
+{
+	"$BINDIR/pg_ctl" -D "$DATA" -m immediate stop >/dev/null 2>&1 || true
+	if [ "${KEEP:-0}" = 1 ]; then
+		echo "cluster kept in $DATA" >&2
+	else
+		rm -rf "$WORK"
+	fi
+}
+trap cleanup EXIT INT TERM
+
+"$BINDIR/initdb" -A trust -U postgres -D "$DATA" >"$WORK/initdb.log"
+"$BINDIR/pg_ctl" -D "$DATA" -w -l "$WORK/server.log" \
+	-o "-p $PORT -k $WORK -c listen_addresses='' -c max_connections=$((CLIENTS + 10))" start >/dev/null
+
+PSQL="$BINDIR/psql -X -q -h $WORK -p $PORT -U postgres"
+$PSQL -d postgres -c "CREATE DATABASE kbench"
+$PSQL -d kbench -v series="$SERIES" -v large="$LARGE" -f "$BENCH/setup.sql"
+VERSION=$($PSQL -d kbench -A -t -c "SHOW server_version" | cut -d' ' -f1)
+
+mkdir -p "$(dirname "$OUT")"
+if [ ! -s "$OUT" ]; then
+	echo "label,server_version,script,lateral,series,clients,duration_s,transactions,tps,lat_avg_ms,lat_p50_ms,lat_p90_ms,lat_p99_ms,lat_max_ms" >"$OUT"
+fi
+
+for script in $SCRIPTS; do
+	for lateral in 0 1; do
+		rm -rf "$WORK/log" && mkdir "$WORK/log"
+		if ! (cd "$WORK/log" && "$BINDIR/pgbench" -n -h "$WORK" -p "$PORT" -U postgres \
+			-c "$CLIENTS" -j "$CLIENTS" -T "$DURATION" -l \
+			-D series="$SERIES" -D large="$LARGE" -D lateral="$lateral" \
+			-f "$BENCH/pgbench/$script.sql" kbench >"$WORK/pgbench.out" 2>&1); then
+			echo "$script lateral=$lateral failed:" >&2
+			tail -5 "$WORK/pgbench.out" >&2
+			continue
+		fi
+
+		# Without initial connection time where pgbench reports both
+		tps=$(awk '/^tps = / { t = $3 } END { print t }' "$WORK/pgbench.out")
+
+		# Third field of the transaction log: latency in microseconds
+		row=$(cat "$WORK"/log/pgbench_log.* | awk '{ print $3 }' | sort -n | awk '
+			{ v[NR] = $1; s += $1 }
+			END {
+				if (NR == 0) { print "0,0,0,0,0,0"; exit }
+				printf "%d,%.3f,%.3f,%.3f,%.3f,%.3f", NR, s / NR / 1000, v[int((NR - 1) * 0.5) + 1] / 1000,
+					v[int((NR - 1) * 0.9) + 1] / 1000, v[int((NR - 1) * 0.99) + 1] / 1000, v[NR] / 1000
+			}')
+		set -- $(echo "$row" | tr ',' ' ')
+		echo "$LABEL,$VERSION,$script,$lateral,$SERIES,$CLIENTS,$DURATION,$1,$tps,$2,$3,$4,$5,$6" | tee -a "$OUT"
+	done
+done
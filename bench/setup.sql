@@ -0,0 +1,94 @@
+-- Schema and data for the pgbench scripts in bench/pgbench, see bench/run.sh
+--
+-- psql -v series=100000 -v large=10 -f bench/setup.sql
+--
+-- Every series is one week of 15 minute quadrants (672 points, see arrays.c) built from the extension's own
+-- generators with a fixed seed, so every run and every release sees identical data.
+--   bench_series - sine wave, random walk and weights per series_id, 1 .. :series
+--   bench_large  - :large random walks of 100000 points each, for the whole-array functions (kbinned etc.)
+
+\set ON_ERROR_STOP on
+\if :{?series}
+\else
+\set series 100000
+\endif
+\if :{?large}
+\else
+\set large 10
+\endif
+
+DROP EXTENSION IF EXISTS "TimeCachePGExtensions" CASCADE;
+CREATE EXTENSION "TimeCachePGExtensions";
+
+-- Functions only declared by series.sql and ManualControl.sql, outside the extension script
+DROP TYPE IF EXISTS __sinewavepoint CASCADE;
+DROP TYPE IF EXISTS __timepoint CASCADE;
+CREATE TYPE __sinewavepoint AS (time timestamp with time zone, val double precision);
+CREATE TYPE __timepoint AS (time timestamp with time zone, val integer);
+
+CREATE OR REPLACE FUNCTION generate_sinewave_series(timestamp with time zone, timestamp with time zone, interval, integer)
+returns SETOF __sinewavepoint
+as '$libdir/TimeCachePGExtensions', 'generate_sinewave_series'
+LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION generate_sinewave_series(timestamp with time zone, timestamp with time zone, interval, integer, integer)
+returns SETOF __sinewavepoint
+as '$libdir/TimeCachePGExtensions', 'generate_sinewave_series'
+LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION generate_randomwalk_series(timestamp with time zone, timestamp with time zone, interval, integer, integer DEFAULT NULL, seed bigint DEFAULT NULL)
+returns SETOF __timepoint
+as '$libdir/TimeCachePGExtensions', 'generate_randomwalk_series'
+LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION ksimple_all(double precision[], int)
+returns TABLE(cluster_number integer, average double precision, minimum double precision, maximum double precision, stddev double precision, numcount integer)
+as '$libdir/TimeCachePGExtensions', 'ksimple_all'
+LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION biggest_breaks(double precision[], int)
+returns int[]
+as '$libdir/TimeCachePGExtensions', 'biggest_breaks'
+LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION quadrants_from_points(double precision[], int[])
+returns double precision[]
+as '$libdir/TimeCachePGExtensions', 'quadrants_from_points'
+LANGUAGE C IMMUTABLE;
+
+-- Data
+DROP TABLE IF EXISTS bench_series;
+DROP TABLE IF EXISTS bench_large;
+
+CREATE TABLE bench_series
+(
+	series_id int PRIMARY KEY,
+	sine double precision[] NOT NULL,
+	walk double precision[] NOT NULL,
+	weights double precision[] NOT NULL
+);
+
+CREATE TABLE bench_large
+(
+	id int PRIMARY KEY,
+	points double precision[] NOT NULL
+);
+
+-- Daily sine waves of different amplitudes, random walks with one seed per series, weights 1 .. 10
+INSERT INTO bench_series
+SELECT s,
+	(SELECT array_agg(val ORDER BY time)
+		FROM generate_sinewave_series('2021-07-04 00:00+00', '2021-07-10 23:45+00', interval '15 minutes', 1440, 10 + s % 90)),
+	(SELECT array_agg(val::double precision ORDER BY time)
+		FROM generate_randomwalk_series('2021-07-04 00:00+00', '2021-07-10 23:45+00', interval '15 minutes', 5, 1000, s)),
+	(SELECT array_agg((1 + (i * 7 + s) % 10)::double precision ORDER BY i) FROM generate_series(1, 672) i)
+FROM generate_series(1, :series) s;
+
+INSERT INTO bench_large
+SELECT l,
+	(SELECT array_agg(val::double precision ORDER BY time)
+		FROM generate_randomwalk_series('2021-01-01 00:00+00', '2021-01-01 00:00+00'::timestamptz + interval '99999 minutes', interval '1 minute', 5, 1000, -l))
+FROM generate_series(1, :large) l;
+
+VACUUM ANALYZE bench_series;
+VACUUM ANALYZE bench_large;
@@ -0,0 +1,315 @@
+#include "kplusplus.h"
+
+/***
+* Exact 1-dimensional k-means (Fisher / Jenks natural breaks)
+*
+* In one dimension an optimal clustering is always a set of contiguous runs of the sorted values,
+* so rather than approximating it with random restarts (kplusplus) we can solve it exactly with a
+* dynamic program over the sorted points (Ckmeans.1d.dp, Wang & Song 2011):
+*
+*   D[q][i] = min over j of ( D[q-1][j-1] + ssq(j, i) )
+*
+* D[q][i] is the lowest within-cluster sum of squares for points 0..i split into q+1 clusters,
+* ssq(j, i) is the sum of squared deviations of points j..i, computed in O(1) from prefix sums.
+*
+* The best j never decreases as i increases, so each row is filled by divide-and-conquer in
+* O(n log n), giving O(k * n log n) overall. The result is deterministic.
+*
+* kexact - returns the stats for the largest cluster (same shape as kplusplus/ksimple)
+* kexact_all - returns stats for every cluster, cluster_number ordered by value
+*
+*/
+PGDLLEXPORT Datum kexact(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum kexact_all(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(kexact);
+PG_FUNCTION_INFO_V1(kexact_all);
+
+
+/// <summary>
+/// Sum of squared deviations from the mean for sorted points j..i (inclusive)
+/// </summary>
+/// <param name="s1">prefix sums of (value - shift), times the weight for weighted points</param>
+/// <param name="s2">prefix sums of (value - shift)^2, likewise</param>
+/// <param name="w">prefix sums of the weights, NULL when every point has weight 1</param>
+/// <returns></returns>
+double fisher_ssq(double* s1, double* s2, double* w, int j, int i)
+{
+	double sum = s1[i + 1] - s1[j];
+	double n = w != NULL ? w[i + 1] - w[j] : (double)(i - j + 1);
+	double ssq = (s2[i + 1] - s2[j]) - (sum * sum) / n;
+
+	// Cancellation can leave tiny negatives for constant runs
+	return ssq > 0.0 ? ssq : 0.0;
+}
+
+/// <summary>
+/// Fill D[q][imin..imax] from the previous row, knowing the optimal first index for each i
+/// lies within [jmin, jmax]. Solves the middle i directly, then splits the j range around its answer.
+/// </summary>
+void fisher_fill_row(int q, int imin, int imax, int jmin, int jmax, double* prev, double* curr, int* back, double* s1, double* s2, double* w)
+{
+	if (imin > imax)
+		return;
+
+	int mid = imin + (imax - imin) / 2;
+	// Cluster q must leave at least one point for each of the q clusters before it
+	int lo = Max(jmin, q);
+	int hi = Min(jmax, mid);
+
+	double best = DBL_MAX;
+	int bestj = lo;
+	for (int j = lo; j <= hi; j++)
+	{
+		double d = prev[j - 1] + fisher_ssq(s1, s2, w, j, mid);
+		if (d < best)
+		{
+			best = d;
+			bestj = j;
+		}
+	}
+	curr[mid] = best;
+	back[mid] = bestj;
+
+	fisher_fill_row(q, imin, mid - 1, jmin, bestj, prev, curr, back, s1, s2, w);
+	fisher_fill_row(q, mid + 1, imax, bestj, jmax, prev, curr, back, s1, s2, w);
+}
+
+/// <summary>
+/// Solve the dynamic program for count sorted points, given their prefix sums (see fisher_ssq()).
+/// Its buffers are left to the caller's call context, see kcall_begin().
+/// </summary>
+/// <param name="starts">k + 1 entries, filled so cluster q is points [starts[q], starts[q + 1])</param>
+/// <returns>the lowest within-cluster sum of squares</returns>
+double fisher_solve(int count, int k, double* s1, double* s2, double* w, int* starts)
+{
+	// Only two rows of D are live at once, but every row of backtrack indices is kept
+	double* prev = palloc(sizeof(double) * count);
+	double* curr = palloc(sizeof(double) * count);
+	int* back = palloc(sizeof(int) * (Size)k * count);
+
+	for (int i = 0; i < count; i++)
+	{
+		prev[i] = fisher_ssq(s1, s2, w, 0, i);
+		back[i] = 0;
+	}
+
+	for (int q = 1; q < k; q++)
+	{
+		int* qback = back + (Size)q * count;
+
+		// The last row is only ever read at the final point
+		int imin = (q == k - 1) ? count - 1 : q;
+		fisher_fill_row(q, imin, count - 1, q, count - 1, prev, curr, qback, s1, s2, w);
+
+		double* temp = prev;
+		prev = curr;
+		curr = temp;
+	}
+	double score = prev[count - 1];
+
+	// Walk the breaks back from the last point
+	int last = count - 1;
+	starts[k] = count;
+	for (int q = k - 1; q >= 0; q--)
+	{
+		starts[q] = back[(Size)q * count + last];
+		last = starts[q] - 1;
+	}
+	return score;
+}
+
+/// <summary>
+/// Optimal k clustering of values. Labels are for the sorted values, and cluster indices increase with value.
+/// </summary>
+/// <param name="values"></param>
+/// <param name="count"></param>
+/// <param name="k"></param>
+/// <returns></returns>
+Cluster* internal_kexact(double* values, int count, int k)
+{
+	Cluster* best = new_cluster(count, k);
+
+	// Working buffers go in the call's context, only best is kept
+	KCall call;
+	kcall_begin(&call);
+
+	double* sorted = palloc(sizeof(double) * count);
+	memcpy(sorted, values, sizeof(double) * count);
+	qsort(sorted, count, sizeof(double), compare_doubles);
+
+	// Shift by the median before summing squares to limit cancellation in ssq()
+	double shift = sorted[count / 2];
+	double* s1 = palloc(sizeof(double) * (count + 1));
+	double* s2 = palloc(sizeof(double) * (count + 1));
+	s1[0] = 0.0;
+	s2[0] = 0.0;
+	for (int i = 0; i < count; i++)
+	{
+		double v = sorted[i] - shift;
+		s1[i + 1] = s1[i] + v;
+		s2[i + 1] = s2[i] + v * v;
+	}
+
+	int* starts = palloc(sizeof(int) * (k + 1));
+	best->score = fisher_solve(count, k, s1, s2, NULL, starts);
+	for (int q = 0; q < k; q++)
+		klabels_fill(&best->labels, starts[q], starts[q + 1], q);
+	accumulate_clusters(kvalues_f8(sorted), &best->labels, count, best->accum, k);
+
+	kcall_end(&call);
+
+	return best;
+}
+
+/// <summary>
+/// internal_kexact() for weighted points, sorted by value with equal values merged (see collapse_weighted_points()).
+/// Each point's own sum of squares counts towards its cluster's, so summaries of several values work too.
+/// </summary>
+/// <returns>k totals in value order</returns>
+ClusterAccum* internal_kexact_weighted(ClusterAccum* points, int count, int k)
+{
+	ClusterAccum* accum = palloc(sizeof(ClusterAccum) * k);
+
+	KCall call;
+	kcall_begin(&call);
+
+	double shift = points[count / 2].mean;
+	double* s1 = palloc(sizeof(double) * (count + 1));
+	double* s2 = palloc(sizeof(double) * (count + 1));
+	double* w = palloc(sizeof(double) * (count + 1));
+	s1[0] = 0.0;
+	s2[0] = 0.0;
+	w[0] = 0.0;
+	for (int i = 0; i < count; i++)
+	{
+		double v = points[i].mean - shift;
+		double n = points[i].count;
+		s1[i + 1] = s1[i] + n * v;
+		s2[i + 1] = s2[i] + points[i].m2 + n * v * v;
+		w[i + 1] = w[i] + n;
+	}
+
+	int* starts = palloc(sizeof(int) * (k + 1));
+	fisher_solve(count, k, s1, s2, w, starts);
+	for (int q = 0; q < k; q++)
+	{
+		accum_reset(&accum[q]);
+		for (int i = starts[q]; i < starts[q + 1]; i++)
+			merge_accum(&accum[q], &points[i]);
+	}
+
+	kcall_end(&call);
+
+	return accum;
+}
+
+Datum kexact(PG_FUNCTION_ARGS)
+{
+	TupleDesc tupDesc;
+
+	if (get_call_result_type(fcinfo, NULL, &tupDesc) != TYPEFUNC_COMPOSITE)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Function call not composite."));
+	if (fcinfo->nargs < 2)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kexact requires two arguments: points,k."));
+	if (PG_ARGISNULL(0))
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kexact called with NULL array."));
+	ArrayType* arr = PG_GETARG_ARRAYTYPE_P(0);
+	if (ARR_NDIM(arr) != 1)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kexact only supports 1-dimensional arrays."));
+	Oid valueType = ARR_ELEMTYPE(arr);
+
+	if (valueType != FLOAT4OID && valueType != FLOAT8OID && valueType != INT8OID && valueType != INT4OID)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kexact supports only integer/float 4/8 types."));
+
+	int array_length = (ARR_DIMS(arr))[0];
+	if (array_length < 1)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kexact empty array."));
+
+	int k = PG_GETARG_INT32(1);
+	if (k < 1)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kexact k must be >= 1, given: %d", k));
+	if (k > array_length)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kexact array length %d less than k: %d", array_length, k));
+
+	double* convArray = get_converted_array(arr, valueType, array_length);
+
+	Cluster* best = internal_kexact(convArray, array_length, k);
+
+	free_converted_array(arr, convArray);
+
+	ClusterStats* allStats = get_all_cluster_stats(best, k);
+
+	free_cluster(best);
+
+	int bigIndex = 0;
+	for (int i = 1; i < k; i++)
+	{
+		if (allStats[i].count > allStats[bigIndex].count)
+			bigIndex = i;
+	}
+	ClusterStats stats = allStats[bigIndex];
+
+	// Convert to record type for return
+	bool isnull[5];
+	for (int i = 0; i < 5; i++)
+		isnull[i] = false;
+	Datum retDat[5];
+	retDat[0] = Float8GetDatum(stats.average);
+	retDat[1] = Float8GetDatum(stats.min);
+	retDat[2] = Float8GetDatum(stats.max);
+	retDat[3] = Float8GetDatum(stats.stddev);
+	retDat[4] = Int32GetDatum(stats.count);
+
+	BlessTupleDesc(tupDesc);
+	HeapTuple hd = heap_form_tuple(tupDesc, retDat, isnull);
+
+	Datum d = HeapTupleGetDatum(hd);
+
+	pfree(allStats);
+
+	PG_RETURN_DATUM(d);
+}
+
+
+/**
+ * kexact, but returns all clusters
+ * implemented as a materialize mode srf
+ */
+Datum kexact_all(PG_FUNCTION_ARGS)
+{
+	if (fcinfo->nargs < 2)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kexact_all requires two arguments: points,k."));
+	if (PG_ARGISNULL(0))
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kexact_all called with NULL array."));
+	ArrayType* arr = PG_GETARG_ARRAYTYPE_P(0);
+	if (ARR_NDIM(arr) != 1)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kexact_all only supports 1-dimensional arrays."));
+	Oid valueType = ARR_ELEMTYPE(arr);
+
+	if (valueType != FLOAT4OID && valueType != FLOAT8OID && valueType != INT8OID && valueType != INT4OID)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kexact_all supports only integer/float 4/8 types."));
+
+	int array_length = (ARR_DIMS(arr))[0];
+	if (array_length < 1)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kexact_all empty array."));
+	int k = PG_GETARG_INT32(1);
+	if (k < 1)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kexact_all k must be >= 1, given: %d", k));
+	if (k > array_length)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kexact_all array length %d less than k: %d", array_length, k));
+
+	TupleDesc tupDesc;
+	Tuplestorestate* tupstore = kmaterialize_begin(fcinfo, &tupDesc);
+
+	double* convArray = get_converted_array(arr, valueType, array_length);
+	Cluster* best = internal_kexact(convArray, array_length, k);
+	free_converted_array(arr, convArray);
+
+	ClusterStats* stats = get_all_cluster_stats(best, k);
+	free_cluster(best);
+
+	kmaterialize_clusters(tupstore, tupDesc, stats, k);
+	pfree(stats);
+
+	return (Datum)0;
+}
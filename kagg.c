@@ -0,0 +1,464 @@
+#include "kplusplus.h"
+#include "krandom.h"
+
+/***
+* kplusplus_agg - k-means++ as an aggregate over rows, instead of over an array_agg'd array
+*
+* The state never holds more than a bounded number of rows. Values are buffered, up to KAGG_PENDING of them,
+* then flushed into a sorted list of summaries, each the running totals (ClusterAccum) of a run of nearby values.
+* A flush sorts the buffer, merges it into the summaries and, if there are more than KAGG_SUMMARIES, merges
+* the adjacent summaries whose merge adds the least to the within-summary sum of squares. Equal values
+* always merge, at no cost, so a column with few distinct values is summarised exactly.
+*
+* Partial states from parallel workers are combined by pooling their summaries and flushing again,
+* and serialize to a flat copy of the summaries.
+*
+* The final function runs weighted k-means++ over the summaries, each a point at its mean with its row count
+* as weight. A summary's rows always land in the same cluster, so this is where the result can differ from
+* kplusplus_all over the same rows; the stats of each cluster are then exact totals of its summaries' rows.
+* With fewer distinct values than KAGG_SUMMARIES nothing is approximated. Merges depend on the order rows
+* arrive in, so parallel plans can give slightly different clusters than serial ones.
+*
+* kplusplus_agg(value, k, seeds, updates [, seed]) returns kcluster[], one element per cluster with the
+* columns of kplusplus_all, ordered by value.
+*/
+PGDLLEXPORT Datum kplusplus_agg_transfn(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum kplusplus_agg_combinefn(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum kplusplus_agg_serialfn(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum kplusplus_agg_deserialfn(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum kplusplus_agg_finalfn(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(kplusplus_agg_transfn);
+PG_FUNCTION_INFO_V1(kplusplus_agg_combinefn);
+PG_FUNCTION_INFO_V1(kplusplus_agg_serialfn);
+PG_FUNCTION_INFO_V1(kplusplus_agg_deserialfn);
+PG_FUNCTION_INFO_V1(kplusplus_agg_finalfn);
+
+// Summaries a flush reduces to, give or take KAGG_SLACK, and values buffered between flushes
+#define KAGG_SUMMARIES 2048
+#define KAGG_SLACK (KAGG_SUMMARIES / 8)
+#define KAGG_PENDING 4096
+#define KAGG_CAPACITY (KAGG_SUMMARIES + KAGG_SLACK + KAGG_PENDING)
+// First allocation of the value buffer, it doubles up to KAGG_PENDING so small groups stay small
+#define KAGG_INITIAL 64
+
+typedef struct
+{
+	int k;
+	int seeds;
+	int updates;
+	bool has_seed;
+	uint64 seed;
+	int64 rows;
+	// Sorted by value, KAGG_CAPACITY long once allocated by the first flush
+	int count;
+	ClusterAccum* summaries;
+	// Values added since the last flush
+	int pending;
+	int pending_capacity;
+	double* values;
+} KAggState;
+
+// Serialized state: the header, then count summaries
+typedef struct
+{
+	int32 k;
+	int32 seeds;
+	int32 updates;
+	int32 count;
+	int64 rows;
+	uint64 seed;
+	bool has_seed;
+} KAggHeader;
+
+/// <summary>
+/// Increase in the sum of squares from merging two summaries
+/// </summary>
+double kagg_merge_cost(ClusterAccum* a, ClusterAccum* b)
+{
+	double delta = a->mean - b->mean;
+	return delta * delta * ((double)a->count * b->count / ((double)a->count + b->count));
+}
+
+/// <summary>
+/// The nth smallest of values (0-based), reordering them. Quickselect with a middle pivot.
+/// </summary>
+double kagg_select(double* values, int count, int nth)
+{
+	int lo = 0;
+	int hi = count - 1;
+	while (lo < hi)
+	{
+		double pivot = values[lo + (hi - lo) / 2];
+		int i = lo;
+		int j = hi;
+		while (i <= j)
+		{
+			while (values[i] < pivot)
+				i++;
+			while (values[j] > pivot)
+				j--;
+			if (i <= j)
+			{
+				double temp = values[i];
+				values[i] = values[j];
+				values[j] = temp;
+				i++;
+				j--;
+			}
+		}
+		if (nth <= j)
+			hi = j;
+		else if (nth >= i)
+			lo = i;
+		else
+			break;
+	}
+	return values[nth];
+}
+
+/// <summary>
+/// Merge adjacent sorted summaries, cheapest first, until at most target + KAGG_SLACK are left.
+/// Each pass finds the cost of the last merge needed to reach target and merges every adjacent pair up to it,
+/// checking the cost again as a summary grows so runs of cheap pairs don't become one wide summary.
+/// That leaves a few more than target, which the next pass would cut down a few at a time: KAGG_SLACK stops there.
+/// </summary>
+void kagg_reduce(KAggState* state, int target)
+{
+	if (state->count - target <= KAGG_SLACK)
+		return;
+
+	ClusterAccum* s = state->summaries;
+	double* costs = palloc(sizeof(double) * state->count);
+
+	while (state->count - target > KAGG_SLACK)
+	{
+		int pairs = state->count - 1;
+		for (int i = 0; i < pairs; i++)
+			costs[i] = kagg_merge_cost(&s[i], &s[i + 1]);
+
+		int needed = state->count - target;
+		double threshold = kagg_select(costs, pairs, needed - 1);
+
+		// A merged mean lies between its parts, so the summaries stay sorted
+		int out = 0;
+		for (int i = 1; i < state->count; i++)
+		{
+			if (needed > 0 && kagg_merge_cost(&s[out], &s[i]) <= threshold)
+			{
+				merge_accum(&s[out], &s[i]);
+				needed--;
+			}
+			else
+				s[++out] = s[i];
+		}
+		state->count = out + 1;
+	}
+
+	pfree(costs);
+}
+
+/// <summary>
+/// Fold the buffered values into the summaries: sort them, merge them into the sorted summaries
+/// with equal values collapsed, then reduce them to about target, see kagg_reduce().
+/// </summary>
+void kagg_flush(KAggState* state, MemoryContext aggcontext, int target)
+{
+	if (state->summaries == NULL)
+		state->summaries = MemoryContextAlloc(aggcontext, sizeof(ClusterAccum) * KAGG_CAPACITY);
+
+	if (state->pending > 0)
+	{
+		double* values = state->values;
+		sort_doubles(values, state->pending);
+
+		// Merge from the back, the summaries have room for every value
+		ClusterAccum* s = state->summaries;
+		int i = state->count - 1;
+		int v = state->pending - 1;
+		int out = state->count + state->pending;
+		while (v >= 0)
+		{
+			if (i >= 0 && s[i].mean > values[v])
+				s[--out] = s[i--];
+			else
+			{
+				out--;
+				accum_reset(&s[out]);
+				accum_add(&s[out], values[v--]);
+			}
+		}
+		state->count += state->pending;
+		state->pending = 0;
+	}
+
+	// Summaries of equal values merge at no cost, so they are always merged
+	state->count = merge_equal_points(state->summaries, state->count);
+
+	kagg_reduce(state, target);
+}
+
+/// <summary>
+/// Buffer one value, flushing when the buffer is at KAGG_PENDING
+/// </summary>
+void kagg_add(KAggState* state, MemoryContext aggcontext, double value)
+{
+	if (state->pending == state->pending_capacity)
+	{
+		if (state->pending_capacity < KAGG_PENDING)
+		{
+			state->pending_capacity *= 2;
+			// repalloc keeps the buffer in aggcontext
+			state->values = repalloc(state->values, sizeof(double) * state->pending_capacity);
+		}
+		else
+			kagg_flush(state, aggcontext, KAGG_SUMMARIES);
+	}
+	state->values[state->pending++] = value;
+}
+
+KAggState* new_kagg_state(MemoryContext aggcontext)
+{
+	KAggState* state = MemoryContextAllocZero(aggcontext, sizeof(KAggState));
+	state->pending_capacity = KAGG_INITIAL;
+	state->values = MemoryContextAlloc(aggcontext, sizeof(double) * KAGG_INITIAL);
+	return state;
+}
+
+void kagg_check_rows(int64 rows)
+{
+	// Cluster counts are int, as in kplusplus_all
+	if (rows > INT_MAX)
+		ereport(ERROR, errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED), errmsg("kplusplus_agg supports at most %d values.", INT_MAX));
+}
+
+Datum kplusplus_agg_transfn(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggcontext;
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kplusplus_agg_transfn called in non-aggregate context."));
+
+	KAggState* state = PG_ARGISNULL(0) ? NULL : (KAggState*)PG_GETARG_POINTER(0);
+
+	if (state == NULL)
+	{
+		if (PG_NARGS() < 5 || PG_ARGISNULL(2) || PG_ARGISNULL(3) || PG_ARGISNULL(4))
+			ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kplusplus_agg requires four arguments: value,k,seeds,updates. Optionally a seed."));
+		int k = PG_GETARG_INT32(2);
+		if (k < 1)
+			ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kplusplus_agg k must be >= 1, given: %d", k));
+		if (k > KAGG_SUMMARIES)
+			ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kplusplus_agg k must be <= %d, given: %d", KAGG_SUMMARIES, k));
+
+		state = new_kagg_state(aggcontext);
+		state->k = k;
+		state->seeds = PG_GETARG_INT32(3) < 1 ? 1 : PG_GETARG_INT32(3);
+		state->updates = PG_GETARG_INT32(4) < 1 ? 1 : PG_GETARG_INT32(4);
+		state->has_seed = PG_NARGS() > 5 && !PG_ARGISNULL(5);
+		state->seed = state->has_seed ? (uint64)PG_GETARG_INT64(5) : 0;
+	}
+
+	// NULL values are skipped, like other aggregates
+	if (PG_ARGISNULL(1))
+		PG_RETURN_POINTER(state);
+
+	double value = PG_GETARG_FLOAT8(1);
+	if (isnan(value) || isinf(value))
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kplusplus_agg does not support NaN or infinite values."));
+
+	kagg_add(state, aggcontext, value);
+	kagg_check_rows(++state->rows);
+
+	PG_RETURN_POINTER(state);
+}
+
+Datum kplusplus_agg_combinefn(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggcontext;
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kplusplus_agg_combinefn called in non-aggregate context."));
+
+	KAggState* into = PG_ARGISNULL(0) ? NULL : (KAggState*)PG_GETARG_POINTER(0);
+	KAggState* from = PG_ARGISNULL(1) ? NULL : (KAggState*)PG_GETARG_POINTER(1);
+
+	if (from == NULL)
+		PG_RETURN_POINTER(into);
+
+	if (into == NULL)
+	{
+		// The combined state has to live in aggcontext, start an empty one with from's arguments
+		into = new_kagg_state(aggcontext);
+		into->k = from->k;
+		into->seeds = from->seeds;
+		into->updates = from->updates;
+		into->has_seed = from->has_seed;
+		into->seed = from->seed;
+	}
+
+	for (int i = 0; i < from->pending; i++)
+		kagg_add(into, aggcontext, from->values[i]);
+
+	if (from->count > 0)
+	{
+		// Both sides hold at most KAGG_SUMMARIES + KAGG_SLACK after a flush, so the pooled summaries fit
+		kagg_flush(into, aggcontext, KAGG_SUMMARIES);
+		memcpy(into->summaries + into->count, from->summaries, sizeof(ClusterAccum) * from->count);
+		into->count += from->count;
+		qsort(into->summaries, into->count, sizeof(ClusterAccum), compare_weighted_points);
+		kagg_flush(into, aggcontext, KAGG_SUMMARIES);
+	}
+
+	into->rows += from->rows;
+	kagg_check_rows(into->rows);
+
+	PG_RETURN_POINTER(into);
+}
+
+/// <summary>
+/// Flushes first, so a partial state is at most KAGG_SUMMARIES + KAGG_SLACK summaries on the wire
+/// </summary>
+Datum kplusplus_agg_serialfn(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggcontext;
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kplusplus_agg_serialfn called in non-aggregate context."));
+
+	KAggState* state = (KAggState*)PG_GETARG_POINTER(0);
+	kagg_flush(state, aggcontext, KAGG_SUMMARIES);
+
+	KAggHeader header;
+	memset(&header, 0, sizeof(KAggHeader));
+	header.k = state->k;
+	header.seeds = state->seeds;
+	header.updates = state->updates;
+	header.count = state->count;
+	header.rows = state->rows;
+	header.seed = state->seed;
+	header.has_seed = state->has_seed;
+
+	Size size = sizeof(KAggHeader) + sizeof(ClusterAccum) * state->count;
+	bytea* result = palloc(VARHDRSZ + size);
+	SET_VARSIZE(result, VARHDRSZ + size);
+	memcpy(VARDATA(result), &header, sizeof(KAggHeader));
+	memcpy(VARDATA(result) + sizeof(KAggHeader), state->summaries, sizeof(ClusterAccum) * state->count);
+
+	PG_RETURN_BYTEA_P(result);
+}
+
+Datum kplusplus_agg_deserialfn(PG_FUNCTION_ARGS)
+{
+	MemoryContext aggcontext;
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kplusplus_agg_deserialfn called in non-aggregate context."));
+
+	bytea* data = PG_GETARG_BYTEA_PP(0);
+	KAggHeader header;
+	if (VARSIZE_ANY_EXHDR(data) < sizeof(KAggHeader))
+		ereport(ERROR, errcode(ERRCODE_DATA_CORRUPTED), errmsg("kplusplus_agg state is truncated."));
+	memcpy(&header, VARDATA_ANY(data), sizeof(KAggHeader));
+	if (header.count < 0 || header.count > KAGG_SUMMARIES + KAGG_SLACK
+		|| VARSIZE_ANY_EXHDR(data) != sizeof(KAggHeader) + sizeof(ClusterAccum) * header.count)
+		ereport(ERROR, errcode(ERRCODE_DATA_CORRUPTED), errmsg("kplusplus_agg state is corrupt."));
+
+	KAggState* state = new_kagg_state(aggcontext);
+	state->k = header.k;
+	state->seeds = header.seeds;
+	state->updates = header.updates;
+	state->rows = header.rows;
+	state->seed = header.seed;
+	state->has_seed = header.has_seed;
+	state->summaries = MemoryContextAlloc(aggcontext, sizeof(ClusterAccum) * KAGG_CAPACITY);
+	state->count = header.count;
+	memcpy(state->summaries, VARDATA_ANY(data) + sizeof(KAggHeader), sizeof(ClusterAccum) * header.count);
+
+	PG_RETURN_POINTER(state);
+}
+
+/// <summary>
+/// Best of seeds weighted k-means++ restarts over the summaries, see internal_kplusplus_weighted()
+/// </summary>
+/// <returns>k totals in value order, allocated in the current context</returns>
+ClusterAccum* kagg_cluster(KAggState* state, uint64 seed)
+{
+	int k = state->k;
+
+	KCall call;
+	kcall_begin(&call);
+
+	// The final function can run more than once on the same state, so flush a copy, without reducing it
+	KAggState copy = *state;
+	copy.count = 0;
+	copy.summaries = NULL;
+	copy.values = palloc(sizeof(double) * (state->pending + 1));
+	memcpy(copy.values, state->values, sizeof(double) * state->pending);
+	kagg_flush(&copy, call.context, INT_MAX);
+	if (state->count > 0)
+	{
+		memcpy(copy.summaries + copy.count, state->summaries, sizeof(ClusterAccum) * state->count);
+		copy.count += state->count;
+		qsort(copy.summaries, copy.count, sizeof(ClusterAccum), compare_weighted_points);
+		kagg_flush(&copy, call.context, INT_MAX);
+	}
+
+	// Equal values are one summary, and seeding needs k of them
+	if (copy.count < k)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kplusplus_agg %d distinct values less than k: %d", copy.count, k));
+
+	MemoryContextSwitchTo(call.caller);
+	ClusterAccum* best = internal_kplusplus_weighted(copy.summaries, copy.count, k, state->seeds, state->updates, seed);
+
+	kcall_end(&call);
+	return best;
+}
+
+/// <summary>
+/// kcluster[] with the stats of every cluster, NULL for no rows
+/// </summary>
+Datum kplusplus_agg_finalfn(PG_FUNCTION_ARGS)
+{
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+	KAggState* state = (KAggState*)PG_GETARG_POINTER(0);
+	if (state->rows == 0)
+		PG_RETURN_NULL();
+
+	Oid array_type = get_fn_expr_rettype(fcinfo->flinfo);
+	Oid element_type = OidIsValid(array_type) ? get_element_type(array_type) : InvalidOid;
+	if (!OidIsValid(element_type))
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kplusplus_agg_finalfn must return an array of kcluster."));
+	TupleDesc tupDesc = BlessTupleDesc(TypeGetTupleDesc(element_type, NIL));
+
+	// Without a seed argument every call draws a fresh seed, as kplusplus does
+	uint64 seed = state->has_seed ? state->seed : krandom_fresh_seed();
+	ClusterAccum* accum = kagg_cluster(state, seed);
+
+	int k = state->k;
+	Datum* elements = palloc(sizeof(Datum) * k);
+	for (int i = 0; i < k; i++)
+	{
+		ClusterStats stats;
+		fill_cluster_stats(&accum[i], &stats);
+
+		bool isnull[6] = { false, false, false, false, false, false };
+		Datum retDat[6];
+		retDat[0] = Int32GetDatum(i);
+		retDat[1] = Float8GetDatum(stats.average);
+		retDat[2] = Float8GetDatum(stats.min);
+		retDat[3] = Float8GetDatum(stats.max);
+		retDat[4] = Float8GetDatum(stats.stddev);
+		retDat[5] = Int32GetDatum(stats.count);
+
+		HeapTuple ht = heap_form_tuple(tupDesc, retDat, isnull);
+		elements[i] = HeapTupleGetDatum(ht);
+	}
+
+	int16 typlen;
+	bool typbyval;
+	char typalign;
+	get_typlenbyvalalign(element_type, &typlen, &typbyval, &typalign);
+	ArrayType* result = construct_array(elements, k, element_type, typlen, typbyval, typalign);
+
+	pfree(elements);
+	pfree(accum);
+
+	PG_RETURN_ARRAYTYPE_P(result);
+}
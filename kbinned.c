@@ -0,0 +1,228 @@
+#include "kplusplus.h"
+
+/***
+* Approximate 1-dimensional k-means for very large arrays: cluster a histogram of the values
+*
+* kexact and kplusplus sort the points, so millions of values cost a sort and every pass after it.
+* When only the cluster bands are wanted, bins of width (max - min) / bins are enough to place them:
+*
+*   1. one pass for the range, one pass adding each value to the count and total of its bin
+*   2. the exact dynamic program of kexact (fisher.c) on the non-empty bins, weighted by their counts
+*   3. one pass adding each value to the band of its bin
+*
+* No sort, and the dynamic program runs on at most bins points whatever the array length.
+* Bins are never split, so the bands are the best k bands whose edges lie on bin edges:
+* edges are only resolved to one bin width, points closer than that to an edge may belong
+* to the band next to it in kexact. The stats of each band are exact for the points in it, from the last pass.
+*
+* kbinned(points, k [, bins]) - stats of the largest band, as kexact, plus bin_width
+* kbinned_all(points, k [, bins]) - every band, cluster_number ordered by value, as kexact_all, plus bin_width
+*
+* bin_width is the approximation error bound reported with the stats: the resolution of the band edges.
+* bins defaults to 4096.
+*/
+PGDLLEXPORT Datum kbinned(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum kbinned_all(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(kbinned);
+PG_FUNCTION_INFO_V1(kbinned_all);
+
+// Fewest and most bins accepted
+#define KBINNED_MIN_BINS 2
+#define KBINNED_MAX_BINS (1 << 24)
+
+/// <summary>
+/// k bands from a bins-bin histogram of the points, see the top of this file
+/// </summary>
+/// <param name="bin_width">set to the width of one bin</param>
+/// <returns>k totals in value order</returns>
+ClusterAccum* internal_kbinned(KValues values, int count, int k, int bins, double* bin_width)
+{
+	kinstrumentation.calls++;
+	ClusterAccum* accum = palloc(sizeof(ClusterAccum) * k);
+	for (int j = 0; j < k; j++)
+		accum_reset(&accum[j]);
+
+	KCall call;
+	kcall_begin(&call);
+
+	double lo;
+	double hi;
+	if (!kvalues_range(values, count, &lo, &hi) || !isfinite(hi - lo))
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kbinned does not support NaN or infinite values, or a range over the largest double."));
+
+	double width = (hi - lo) / bins;
+	double scale = width > 0.0 ? 1.0 / width : 0.0;
+	*bin_width = width;
+
+	int* counts = palloc0(sizeof(int) * bins);
+	double* sums = palloc0(sizeof(double) * bins);
+	kvalues_bin(values, count, lo, scale, bins, counts, sums);
+
+	// The non-empty bins as weighted points at the mean of their values, in value order
+	ClusterAccum* points = palloc(sizeof(ClusterAccum) * bins);
+	int pc = 0;
+	for (int b = 0; b < bins; b++)
+	{
+		if (counts[b] > 0)
+		{
+			ClusterAccum* p = &points[pc++];
+			p->count = counts[b];
+			p->mean = sums[b] / counts[b];
+			p->m2 = 0.0;
+			p->min = p->mean;
+			p->max = p->mean;
+		}
+	}
+	if (pc < k)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kbinned %d non-empty bins less than k: %d", pc, k));
+
+	// The spread within each bin is the same whatever bands the bins go in, so the bin means are enough to pick them
+	ClusterAccum* bands = internal_kexact_weighted(points, pc, k);
+
+	// Band of every bin, from the band counts. Empty bins go in the band after them
+	int* bin_cluster = palloc(sizeof(int) * bins);
+	int j = 0;
+	int left = bands[0].count;
+	for (int b = 0; b < bins; b++)
+	{
+		bin_cluster[b] = j;
+		left -= counts[b];
+		if (left == 0 && j < k - 1)
+		{
+			j++;
+			left = bands[j].count;
+		}
+	}
+
+	kvalues_accumulate_bins(values, count, lo, scale, bins, bin_cluster, accum);
+
+	kcall_end(&call);
+
+	return accum;
+}
+
+/// <summary>
+/// The array and bins arguments of kbinned and kbinned_all, checked
+/// </summary>
+KValues get_kbinned_args(FunctionCallInfo fcinfo, const char* name, ArrayType** arr, int* count, int* k, int* bins)
+{
+	if (fcinfo->nargs < 2)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("%s requires two arguments: points,k. Optionally a bin count.", name));
+	if (PG_ARGISNULL(0))
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("%s called with NULL array.", name));
+	*arr = PG_GETARG_ARRAYTYPE_P(0);
+	if (ARR_NDIM(*arr) != 1)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("%s only supports 1-dimensional arrays.", name));
+	Oid valueType = ARR_ELEMTYPE(*arr);
+
+	if (valueType != FLOAT4OID && valueType != FLOAT8OID && valueType != INT8OID && valueType != INT4OID)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("%s supports only integer/float 4/8 types.", name));
+
+	*count = (ARR_DIMS(*arr))[0];
+	if (*count < 1)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("%s empty array.", name));
+
+	*k = PG_GETARG_INT32(1);
+	if (*k < 1)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("%s k must be >= 1, given: %d", name, *k));
+	if (*k > *count)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("%s array length %d less than k: %d", name, *count, *k));
+
+	*bins = fcinfo->nargs > 2 && !PG_ARGISNULL(2) ? PG_GETARG_INT32(2) : 4096;
+	if (*bins < KBINNED_MIN_BINS || *bins > KBINNED_MAX_BINS)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("%s bins must be in [%d, %d], given: %d", name, KBINNED_MIN_BINS, KBINNED_MAX_BINS, *bins));
+	if (*bins < *k)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("%s bins %d less than k: %d", name, *bins, *k));
+
+	return get_array_values(*arr, valueType, *count);
+}
+
+Datum kbinned(PG_FUNCTION_ARGS)
+{
+	TupleDesc tupDesc;
+
+	if (get_call_result_type(fcinfo, NULL, &tupDesc) != TYPEFUNC_COMPOSITE)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Function call not composite."));
+
+	ArrayType* arr;
+	int array_length;
+	int k;
+	int bins;
+	KValues values = get_kbinned_args(fcinfo, "kbinned", &arr, &array_length, &k, &bins);
+
+	double bin_width;
+	ClusterAccum* accum = internal_kbinned(values, array_length, k, bins, &bin_width);
+
+	free_array_values(arr, values);
+
+	int bigIndex = 0;
+	for (int i = 1; i < k; i++)
+	{
+		if (accum[i].count > accum[bigIndex].count)
+			bigIndex = i;
+	}
+	ClusterStats stats;
+	fill_cluster_stats(&accum[bigIndex], &stats);
+	pfree(accum);
+
+	// Convert to record type for return
+	bool isnull[6];
+	for (int i = 0; i < 6; i++)
+		isnull[i] = false;
+	Datum retDat[6];
+	retDat[0] = Float8GetDatum(stats.average);
+	retDat[1] = Float8GetDatum(stats.min);
+	retDat[2] = Float8GetDatum(stats.max);
+	retDat[3] = Float8GetDatum(stats.stddev);
+	retDat[4] = Int32GetDatum(stats.count);
+	retDat[5] = Float8GetDatum(bin_width);
+
+	BlessTupleDesc(tupDesc);
+	HeapTuple hd = heap_form_tuple(tupDesc, retDat, isnull);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(hd));
+}
+
+/**
+ * kbinned, but returns all bands
+ * implemented as a materialize mode srf
+ */
+Datum kbinned_all(PG_FUNCTION_ARGS)
+{
+	ArrayType* arr;
+	int array_length;
+	int k;
+	int bins;
+	KValues values = get_kbinned_args(fcinfo, "kbinned_all", &arr, &array_length, &k, &bins);
+
+	TupleDesc tupDesc;
+	Tuplestorestate* tupstore = kmaterialize_begin(fcinfo, &tupDesc);
+
+	double bin_width;
+	ClusterAccum* accum = internal_kbinned(values, array_length, k, bins, &bin_width);
+
+	free_array_values(arr, values);
+
+	// kmaterialize_clusters() plus the bin width
+	bool isnull[7] = { false, false, false, false, false, false, false };
+	Datum retDat[7];
+	retDat[6] = Float8GetDatum(bin_width);
+
+	for (int i = 0; i < k; i++)
+	{
+		ClusterStats stats;
+		fill_cluster_stats(&accum[i], &stats);
+
+		retDat[0] = Int32GetDatum(i);
+		retDat[1] = Float8GetDatum(stats.average);
+		retDat[2] = Float8GetDatum(stats.min);
+		retDat[3] = Float8GetDatum(stats.max);
+		retDat[4] = Float8GetDatum(stats.stddev);
+		retDat[5] = Int32GetDatum(stats.count);
+
+		tuplestore_putvalues(tupstore, tupDesc, retDat, isnull);
+	}
+	pfree(accum);
+
+	return (Datum)0;
+}
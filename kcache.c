@@ -0,0 +1,246 @@
+#include "kcache.h"
+#include "kshared.h"
+#include "kxxhash.h"
+#include "lib/ilist.h"
+#include "utils/hsearch.h"
+
+/**
+* Backend-local LRU cache of clustering results
+*
+* The clustering functions are IMMUTABLE: the same array and arguments always give the same clusters,
+* as long as kplusplus is given a seed. Dashboards call them with byte-identical arrays many times over
+* in the same pooled connection, so the stats of every cluster are kept, keyed by a hash of the array's
+* elements and everything else the result depends on (KCacheTag). A hit returns the stats without
+* reading the points again.
+*
+* Off by default: timecache.kplusplus_cache_size is the budget in kB, 0 disables the cache and frees it.
+* Entries are charged for the array bytes they keep (to rule out hash collisions) and their stats,
+* the least recently used ones are evicted to stay within the budget.
+* Only kplusplus calls given a seed are cached, unseeded ones pick a fresh seed every time.
+*
+* Hits, misses and evictions are counted in kinstrumentation, cache_memory is the bytes in use now.
+*
+* When the library is in shared_preload_libraries, results missing here are looked up in the shared
+* cache of kshared.c next, and every new result is stored in both.
+*/
+
+// Cache budget in kB, 0 disables it. Set by timecache.kplusplus_cache_size
+int kplusplus_cache_size = 0;
+
+typedef struct
+{
+	KCacheTag tag; // hash key, must be first
+	dlist_node lru;
+	Size size; // bytes charged to the budget
+	Size nbytes;
+	char* data; // the array's elements
+	int k;
+	ClusterStats* stats;
+} KCacheEntry;
+
+// Everything below lives in kcache_context, NULL until the first store
+static MemoryContext kcache_context = NULL;
+static HTAB* kcache_table = NULL;
+static dlist_head kcache_lru;
+static Size kcache_used = 0;
+
+static Size kcache_budget(void)
+{
+	return (Size)kplusplus_cache_size * 1024;
+}
+
+/// <summary>
+/// Bytes of the array's elements, which follow its header and null bitmap
+/// </summary>
+Size kcache_array_bytes(ArrayType* arr)
+{
+	return ARR_SIZE(arr) - ARR_DATA_OFFSET(arr);
+}
+
+/// <summary>
+/// Drop the least recently used entries until size more bytes fit in the budget
+/// </summary>
+static void kcache_evict(Size size)
+{
+	while (kcache_used + size > kcache_budget() && !dlist_is_empty(&kcache_lru))
+	{
+		KCacheEntry* entry = dlist_tail_element(KCacheEntry, lru, &kcache_lru);
+		dlist_delete(&entry->lru);
+		pfree(entry->data);
+		pfree(entry->stats);
+		kcache_used -= entry->size;
+		hash_search(kcache_table, &entry->tag, HASH_REMOVE, NULL);
+		kinstrumentation.cache_evictions++;
+	}
+}
+
+/// <summary>
+/// Free every entry and the table
+/// </summary>
+void kcache_clear(void)
+{
+	if (kcache_context != NULL)
+		MemoryContextDelete(kcache_context);
+	kcache_context = NULL;
+	kcache_table = NULL;
+	kcache_used = 0;
+}
+
+/// <summary>
+/// True if results should be cached. Also applies a budget lowered since the last call
+/// </summary>
+bool kcache_enabled(void)
+{
+	if (kplusplus_cache_size <= 0)
+		kcache_clear();
+	else if (kcache_context != NULL)
+		kcache_evict(0);
+	return kplusplus_cache_size > 0 || kshared_enabled();
+}
+
+/// <summary>
+/// The identity of one clustering call on arr
+/// </summary>
+/// <returns>false if the result can't be cached: arrays with nulls are rejected by the clustering functions anyway</returns>
+bool kcache_tag(KCacheTag* tag, KCacheKind kind, ArrayType* arr, int k, int seeds, int updates, uint64 seed)
+{
+	if (ARR_HASNULL(arr))
+		return false;
+
+	memset(tag, 0, sizeof(KCacheTag));
+	tag->hash = kxxhash64(ARR_DATA_PTR(arr), kcache_array_bytes(arr), 0);
+	tag->kind = kind;
+	tag->type = ARR_ELEMTYPE(arr);
+	tag->count = ARR_DIMS(arr)[0];
+	tag->k = k;
+	tag->seeds = seeds;
+	tag->updates = updates;
+	tag->seed = seed;
+	if (kind == KCACHE_KPLUSPLUS)
+	{
+		tag->settings[0] = kplusplus_bounded_threshold;
+		tag->settings[1] = kplusplus_compress_ratio;
+		tag->settings[2] = kplusplus_sample_threshold;
+		tag->settings[3] = kplusplus_batch_size;
+		tag->settings[4] = kplusplus_parallel_threshold; // chunked passes merge totals in a different order
+	}
+	return true;
+}
+
+/// <summary>
+/// The stats in this backend's cache for tag, if arr is the array they were computed from
+/// </summary>
+static ClusterStats* kcache_local_lookup(KCacheTag* tag, ArrayType* arr)
+{
+	KCacheEntry* entry = kcache_table != NULL ? hash_search(kcache_table, tag, HASH_FIND, NULL) : NULL;
+	Size nbytes = kcache_array_bytes(arr);
+
+	if (entry == NULL || entry->nbytes != nbytes || memcmp(entry->data, ARR_DATA_PTR(arr), nbytes) != 0)
+	{
+		kinstrumentation.cache_misses++;
+		return NULL;
+	}
+
+	kinstrumentation.cache_hits++;
+	dlist_move_head(&kcache_lru, &entry->lru);
+
+	ClusterStats* stats = palloc(sizeof(ClusterStats) * entry->k);
+	memcpy(stats, entry->stats, sizeof(ClusterStats) * entry->k);
+	return stats;
+}
+
+/// <summary>
+/// Keep the stats of all tag->k clusters computed from arr in this backend, evicting older entries to make room.
+/// Results larger than the whole budget are not kept.
+/// </summary>
+static void kcache_local_store(KCacheTag* tag, ArrayType* arr, ClusterStats* stats)
+{
+	Size nbytes = kcache_array_bytes(arr);
+	Size size = sizeof(KCacheEntry) + nbytes + sizeof(ClusterStats) * tag->k;
+	if (size > kcache_budget())
+		return;
+
+	if (kcache_context == NULL)
+	{
+		kcache_context = AllocSetContextCreate(TopMemoryContext, "timecache result cache", ALLOCSET_DEFAULT_SIZES);
+
+		HASHCTL ctl;
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(KCacheTag);
+		ctl.entrysize = sizeof(KCacheEntry);
+		ctl.hcxt = kcache_context;
+		kcache_table = hash_create("timecache result cache", 256, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+		dlist_init(&kcache_lru);
+	}
+
+	// A hash collision with a different array: the newer result replaces it
+	KCacheEntry* old = hash_search(kcache_table, tag, HASH_FIND, NULL);
+	if (old != NULL)
+	{
+		dlist_delete(&old->lru);
+		pfree(old->data);
+		pfree(old->stats);
+		kcache_used -= old->size;
+		hash_search(kcache_table, tag, HASH_REMOVE, NULL);
+	}
+
+	kcache_evict(size);
+
+	// Copies first, so an out of memory error can't leave a half filled entry in the table
+	char* data = MemoryContextAlloc(kcache_context, nbytes);
+	memcpy(data, ARR_DATA_PTR(arr), nbytes);
+	ClusterStats* copy = MemoryContextAlloc(kcache_context, sizeof(ClusterStats) * tag->k);
+	memcpy(copy, stats, sizeof(ClusterStats) * tag->k);
+
+	KCacheEntry* entry = hash_search(kcache_table, tag, HASH_ENTER, NULL);
+	entry->size = size;
+	entry->nbytes = nbytes;
+	entry->data = data;
+	entry->k = tag->k;
+	entry->stats = copy;
+	dlist_push_head(&kcache_lru, &entry->lru);
+	kcache_used += size;
+}
+
+/// <summary>
+/// The cached stats for tag, from this backend's cache or else the shared one
+/// </summary>
+/// <returns>a copy of the stats of all tag->k clusters in the current context, or NULL on a miss</returns>
+ClusterStats* kcache_lookup(KCacheTag* tag, ArrayType* arr)
+{
+	ClusterStats* stats = kplusplus_cache_size > 0 ? kcache_local_lookup(tag, arr) : NULL;
+	if (stats == NULL && kshared_enabled())
+	{
+		stats = kshared_lookup(tag, arr);
+		if (stats != NULL && kplusplus_cache_size > 0)
+			kcache_local_store(tag, arr, stats);
+	}
+	return stats;
+}
+
+/// <summary>
+/// Cache the stats of all tag->k clusters computed from arr, in this backend and the shared cache
+/// </summary>
+void kcache_store(KCacheTag* tag, ArrayType* arr, ClusterStats* stats)
+{
+	if (kplusplus_cache_size > 0)
+		kcache_local_store(tag, arr, stats);
+	if (kshared_enabled())
+		kshared_store(tag, arr, stats, NULL);
+}
+
+/// <summary>
+/// Bytes the cache is charged for now
+/// </summary>
+int64 kcache_memory(void)
+{
+	return (int64)kcache_used;
+}
+
+/// <summary>
+/// Results in this backend's cache
+/// </summary>
+int64 kcache_entries(void)
+{
+	return kcache_table != NULL ? hash_get_num_entries(kcache_table) : 0;
+}
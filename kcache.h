@@ -0,0 +1,39 @@
+#pragma once
+
+#include "kplusplus.h"
+
+/**
+* Backend-local cache of clustering results, see kcache.c
+*/
+
+// Which clustering a cached result came from
+typedef enum
+{
+	KCACHE_KPLUSPLUS,
+	KCACHE_KSIMPLE
+} KCacheKind;
+
+// Everything one clustering result depends on. Compared as bytes, so always zeroed first (see kcache_tag())
+typedef struct
+{
+	uint64 hash; // kxxhash64() of the array's elements
+	int32 kind;
+	Oid type;
+	int32 count;
+	int32 k;
+	int32 seeds;
+	int32 updates;
+	uint64 seed;
+	int32 settings[5]; // kplusplus GUCs that change its results
+} KCacheTag;
+
+extern int kplusplus_cache_size;
+
+bool kcache_enabled(void);
+bool kcache_tag(KCacheTag* tag, KCacheKind kind, ArrayType* arr, int k, int seeds, int updates, uint64 seed);
+ClusterStats* kcache_lookup(KCacheTag* tag, ArrayType* arr);
+void kcache_store(KCacheTag* tag, ArrayType* arr, ClusterStats* stats);
+void kcache_clear(void);
+int64 kcache_memory(void);
+int64 kcache_entries(void);
+Size kcache_array_bytes(ArrayType* arr);
@@ -0,0 +1,231 @@
+/**
+* Kernels reading the sorted point values, one copy per element type of KValues
+*
+* No include guard: kplusplus.c includes this once per type, with KT defined as the element type
+* and KFN(name) naming that copy. float4 points are widened as they are read, everything
+* computed from them (distances, totals, sums) stays double.
+* The D^2 seeding round has SIMD versions per type instead, see ksimd.c
+*/
+
+/// <summary>
+/// Label points [begin, end) from the boundaries of ordered centroids, see reassign_points_sorted().
+/// Sorted points form one run per cluster, so each run is found with a compare-only scan and labelled in one fill.
+/// reassign compares against the current labels, otherwise they are just written.
+/// </summary>
+/// <returns>true if reassign and any label changed</returns>
+bool KFN(assign_sorted_range)(KLabels* labels, KT* points, int begin, int end, double* bounds, int k, bool reassign)
+{
+	bool moved = false;
+
+	// Labels only increase along sorted points, so starting from 0 reaches the same cluster as one sweep
+	int c = 0;
+	int i = begin;
+	while (i < end)
+	{
+		while (c < k - 1 && (double)points[i] > bounds[c])
+			c++;
+
+		int e = end;
+		if (c < k - 1)
+		{
+			double bound = bounds[c];
+			e = i + 1;
+			while (e < end && (double)points[e] <= bound)
+				e++;
+		}
+
+		if (reassign)
+			moved = klabels_refill(labels, i, e, c) || moved;
+		else
+			klabels_fill(labels, i, e, c);
+		i = e;
+	}
+	return moved;
+}
+
+/// <summary>
+/// accumulate_clusters() over points [begin, end)
+/// </summary>
+void KFN(accumulate_range)(KT* values, KLabels* labels, int begin, int end, ClusterAccum* accum)
+{
+	for (int i = begin; i < end; i++)
+		accum_add(&accum[klabel(labels, i)], (double)values[i]);
+}
+
+/// <summary>
+/// First index in [lo, pc) with arr[i] > bound, or pc
+/// </summary>
+int KFN(upper_bound_index)(KT* arr, int lo, int pc, double bound)
+{
+	int hi = pc;
+	while (lo < hi)
+	{
+		int mid = lo + (hi - lo) / 2;
+		if ((double)arr[mid] > bound)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+/// <summary>
+/// Walk a cluster start from its old position s to the first point above bound
+/// </summary>
+int KFN(move_boundary)(KT* arr, int s, int pc, double bound)
+{
+	while (s < pc && (double)arr[s] <= bound)
+		s++;
+	while (s > 0 && (double)arr[s - 1] > bound)
+		s--;
+	return s;
+}
+
+/// <summary>
+/// One k-means|| round over sorted points: lower each point's D^2 to its distance from the nearest
+/// of the nc sorted candidates, and fill cdf with the running total. The points nearest each candidate
+/// are the run up to the midpoint with the next one, found by binary search.
+/// </summary>
+/// <returns>total weight</returns>
+double KFN(d2_round_sorted)(KT* points, int pc, const double* candidates, int nc, double* mindist, double* cdf)
+{
+	double total = 0.0;
+	int begin = 0;
+	for (int j = 0; j < nc; j++)
+	{
+		int end = j < nc - 1 ? KFN(upper_bound_index)(points, begin, pc, candidates[j] + (candidates[j + 1] - candidates[j]) / 2.0) : pc;
+		double c = candidates[j];
+		for (int i = begin; i < end; i++)
+		{
+			double d = (double)points[i] - c;
+			if (d * d < mindist[i])
+				mindist[i] = d * d;
+			total += mindist[i];
+			cdf[i] = total;
+		}
+		begin = end;
+	}
+	return total;
+}
+
+/// <summary>
+/// sums[i] is the total of the first i points, each less shift
+/// </summary>
+void KFN(prefix_sums)(KT* arr, int pc, double shift, double* sums)
+{
+	sums[0] = 0.0;
+	for (int i = 0; i < pc; i++)
+		sums[i + 1] = sums[i] + ((double)arr[i] - shift);
+}
+
+/// <summary>
+/// Number of distinct values in sorted values, stopping once it is over limit
+/// </summary>
+int KFN(distinct_sorted)(KT* values, int count, int limit)
+{
+	int distinct = count > 0 ? 1 : 0;
+	for (int i = 1; i < count && distinct <= limit; i++)
+	{
+		if (values[i] != values[i - 1])
+			distinct++;
+	}
+	return distinct;
+}
+
+/// <summary>
+/// Run-length encode sorted values as weighted points, one per distinct value
+/// </summary>
+/// <returns>the number of points</returns>
+int KFN(compress_sorted)(KT* values, int count, ClusterAccum* points)
+{
+	int pc = 0;
+	int i = 0;
+	while (i < count)
+	{
+		int e = i + 1;
+		while (e < count && values[e] == values[i])
+			e++;
+
+		ClusterAccum* p = &points[pc++];
+		p->count = e - i;
+		p->mean = (double)values[i];
+		p->m2 = 0.0;
+		p->min = (double)values[i];
+		p->max = (double)values[i];
+		i = e;
+	}
+	return pc;
+}
+
+/// <summary>
+/// Smallest and largest of values
+/// </summary>
+/// <returns>false if any value is NaN</returns>
+bool KFN(value_range)(KT* values, int count, double* min, double* max)
+{
+	KT lo = values[0];
+	KT hi = values[0];
+	bool nan = false;
+	for (int i = 0; i < count; i++)
+	{
+		nan |= values[i] != values[i];
+		if (values[i] < lo)
+			lo = values[i];
+		if (values[i] > hi)
+			hi = values[i];
+	}
+	*min = (double)lo;
+	*max = (double)hi;
+	return !nan;
+}
+
+/// <summary>
+/// Add values to the count and total of their kbin_index() bins
+/// </summary>
+void KFN(bin_values)(KT* values, int count, double lo, double scale, int bins, int* counts, double* sums)
+{
+	for (int i = 0; i < count; i++)
+	{
+		double v = (double)values[i];
+		int b = kbin_index(v, lo, scale, bins);
+		counts[b]++;
+		sums[b] += v;
+	}
+}
+
+/// <summary>
+/// accumulate_clusters() with each point in the cluster of its kbin_index() bin
+/// </summary>
+void KFN(accumulate_bins)(KT* values, int count, double lo, double scale, int bins, int* bin_cluster, ClusterAccum* accum)
+{
+	for (int i = 0; i < count; i++)
+	{
+		double v = (double)values[i];
+		accum_add(&accum[bin_cluster[kbin_index(v, lo, scale, bins)]], v);
+	}
+}
+
+/// <summary>
+/// prefix_sums() with squares[i] the total of the squares of the first i points, each less shift
+/// </summary>
+void KFN(prefix_squares)(KT* arr, int pc, double shift, double* sums, double* squares)
+{
+	sums[0] = 0.0;
+	squares[0] = 0.0;
+	for (int i = 0; i < pc; i++)
+	{
+		double v = (double)arr[i] - shift;
+		sums[i + 1] = sums[i] + v;
+		squares[i + 1] = squares[i] + v * v;
+	}
+}
+
+bool KFN(is_sorted_ascending)(KT* values, int count)
+{
+	for (int i = 1; i < count; i++)
+	{
+		if (values[i] < values[i - 1])
+			return false;
+	}
+	return true;
+}
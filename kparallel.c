@@ -0,0 +1,272 @@
+#include "kplusplus.h"
+#include "kpool.h"
+
+/**
+* Chunked versions of the clustering passes, for large arrays
+*
+* Points are cut into fixed KCHUNK_POINTS pieces. Each chunk writes only its own labels and its own
+* partial result slot, and the slots are merged on the calling thread in chunk order, so the result
+* is the same for any value of timecache.kplusplus_threads.
+* The merge order differs from a single serial pass, so totals can differ from the serial kernels in the last bits.
+*
+* Every function takes a KChunks from new_kchunks(), NULL runs the serial kernel.
+* Only call these from the backend thread: the chunks are spread over worker threads themselves.
+*/
+
+// Arrays at least this long use the chunked passes, -1 never does. Set by timecache.kplusplus_parallel_threshold.
+// Four chunks, so four threads have a chunk each. Not yet tuned by a scaling run: that wants
+// bench/kbench -t 1,2,4,8,16 -P <threshold> on a machine with at least 16 cores
+int kplusplus_parallel_threshold = 262144;
+
+/// <summary>
+/// Buffers for chunked passes over pc points, or NULL if the array is below timecache.kplusplus_parallel_threshold
+/// </summary>
+KChunks* new_kchunks(int pc, int k)
+{
+	if (kplusplus_parallel_threshold < 0 || pc < kplusplus_parallel_threshold)
+		return NULL;
+
+	KChunks* chunks = palloc(sizeof(KChunks));
+	chunks->threads = kplusplus_threads;
+	chunks->count = (pc + KCHUNK_POINTS - 1) / KCHUNK_POINTS;
+	chunks->k = k;
+	chunks->partials = palloc(sizeof(ClusterAccum) * chunks->count * k);
+	chunks->totals = palloc(sizeof(double) * chunks->count);
+	chunks->moved = palloc(sizeof(bool) * chunks->count);
+	return chunks;
+}
+
+void free_kchunks(KChunks* chunks)
+{
+	pfree(chunks->moved);
+	pfree(chunks->totals);
+	pfree(chunks->partials);
+	pfree(chunks);
+}
+
+/// <summary>
+/// Fold the totals of from into into, see accumulate_clusters().
+/// Chan et al. pairwise update: exact counts, min and max, the mean and m2 as if accumulated in one pass.
+/// </summary>
+void merge_accum(ClusterAccum* into, ClusterAccum* from)
+{
+	if (from->count == 0)
+		return;
+	if (into->count == 0)
+	{
+		*into = *from;
+		return;
+	}
+
+	double n = (double)into->count + from->count;
+	double delta = from->mean - into->mean;
+	into->mean += delta * from->count / n;
+	into->m2 += from->m2 + delta * delta * ((double)into->count * from->count / n);
+	if (from->min < into->min)
+		into->min = from->min;
+	if (from->max > into->max)
+		into->max = from->max;
+	into->count += from->count;
+}
+
+typedef struct
+{
+	KChunks* chunks;
+	KLabels* labels;
+	double* arr;
+	KValues values;
+	double* centroids;
+	double* bounds;
+	int* starts;
+	double* mindist;
+	double* cdf;
+	double newest;
+	bool reassign;
+} KChunkArgs;
+
+static void accumulate_chunk(void* arg, int chunk, int begin, int end)
+{
+	KChunkArgs* a = (KChunkArgs*)arg;
+	kvalues_accumulate(a->values, a->labels, begin, end, a->chunks->partials + (size_t)chunk * a->chunks->k, a->chunks->k);
+}
+
+/// <summary>
+/// accumulate_clusters(), one chunk at a time
+/// </summary>
+void accumulate_clusters_chunked(KChunks* chunks, KValues values, KLabels* labels, int pc, ClusterAccum* accum, int k)
+{
+	if (chunks == NULL)
+	{
+		accumulate_clusters(values, labels, pc, accum, k);
+		return;
+	}
+
+	KChunkArgs a = { 0 };
+	a.chunks = chunks;
+	a.values = values;
+	a.labels = labels;
+	kpool_run_chunks(chunks->threads, pc, KCHUNK_POINTS, accumulate_chunk, &a);
+
+	for (int j = 0; j < k; j++)
+		accum[j].count = 0;
+	for (int c = 0; c < chunks->count; c++)
+	{
+		for (int j = 0; j < k; j++)
+			merge_accum(&accum[j], &chunks->partials[(size_t)c * k + j]);
+	}
+	// Empty clusters keep the same totals accumulate_clusters() gives them
+	for (int j = 0; j < k; j++)
+	{
+		if (accum[j].count == 0)
+		{
+			accum[j].mean = 0.0;
+			accum[j].m2 = 0.0;
+			accum[j].min = DBL_MAX;
+			accum[j].max = -DBL_MAX;
+		}
+	}
+}
+
+static void sweep_chunk(void* arg, int chunk, int begin, int end)
+{
+	KChunkArgs* a = (KChunkArgs*)arg;
+	a->chunks->moved[chunk] = kvalues_assign_sorted(a->values, a->labels, begin, end, a->bounds, a->chunks->k, a->reassign);
+}
+
+/// <summary>
+/// reassign_points_sorted() when reassign is set, kplus_assign_sorted() for the first assignment
+/// </summary>
+/// <returns>true if any point changed cluster, always true for the first assignment</returns>
+bool assign_sorted_chunked(KChunks* chunks, KLabels* labels, KValues values, int pc, double* centroids, double* bounds, int k, bool reassign)
+{
+	if (chunks == NULL)
+	{
+		if (reassign)
+			return reassign_points_sorted(labels, values, pc, centroids, bounds, k);
+		kplus_assign_sorted(labels, values, pc, centroids, bounds, k);
+		return true;
+	}
+
+	compute_boundaries(centroids, k, bounds);
+
+	KChunkArgs a = { 0 };
+	a.chunks = chunks;
+	a.labels = labels;
+	a.values = values;
+	a.bounds = bounds;
+	a.reassign = reassign;
+	kpool_run_chunks(chunks->threads, pc, KCHUNK_POINTS, sweep_chunk, &a);
+
+	if (!reassign)
+		return true;
+	bool moved = false;
+	for (int c = 0; c < chunks->count; c++)
+		moved = moved || chunks->moved[c];
+	return moved;
+}
+
+static void scan_chunk(void* arg, int chunk, int begin, int end)
+{
+	KChunkArgs* a = (KChunkArgs*)arg;
+	kplus_assign_c(a->labels, a->arr, begin, end, a->centroids, a->chunks->k);
+}
+
+/// <summary>
+/// kplus_assign_c(), one chunk at a time
+/// </summary>
+void assign_scan_chunked(KChunks* chunks, KLabels* labels, double* arr, int pc, double* centroids, int k)
+{
+	if (chunks == NULL)
+	{
+		kplus_assign_c(labels, arr, 0, pc, centroids, k);
+		return;
+	}
+
+	KChunkArgs a = { 0 };
+	a.chunks = chunks;
+	a.labels = labels;
+	a.arr = arr;
+	a.centroids = centroids;
+	kpool_run_chunks(chunks->threads, pc, KCHUNK_POINTS, scan_chunk, &a);
+}
+
+static void label_chunk(void* arg, int chunk, int begin, int end)
+{
+	KChunkArgs* a = (KChunkArgs*)arg;
+	label_ranges(a->labels, begin, end, a->starts, a->chunks->k);
+}
+
+/// <summary>
+/// Label sorted points from contiguous cluster ranges: cluster j is [starts[j], starts[j + 1])
+/// </summary>
+void label_ranges_chunked(KChunks* chunks, KLabels* labels, int pc, int* starts, int k)
+{
+	if (chunks == NULL)
+	{
+		label_ranges(labels, 0, pc, starts, k);
+		return;
+	}
+
+	KChunkArgs a = { 0 };
+	a.chunks = chunks;
+	a.labels = labels;
+	a.starts = starts;
+	kpool_run_chunks(chunks->threads, pc, KCHUNK_POINTS, label_chunk, &a);
+}
+
+static void d2_chunk(void* arg, int chunk, int begin, int end)
+{
+	KChunkArgs* a = (KChunkArgs*)arg;
+	a->chunks->totals[chunk] = kvalues_d2_round(a->values, begin, end, a->newest, a->mindist, a->cdf);
+}
+
+/// <summary>
+/// kvalues_d2_round(), one chunk at a time. cdf restarts from 0 in every chunk, see choose_weighted_chunked()
+/// </summary>
+/// <returns>total weight</returns>
+double d2_round_chunked(KChunks* chunks, KValues points, int pc, double newest, double* mindist, double* cdf)
+{
+	if (chunks == NULL)
+		return kvalues_d2_round(points, 0, pc, newest, mindist, cdf);
+
+	KChunkArgs a = { 0 };
+	a.chunks = chunks;
+	a.values = points;
+	a.newest = newest;
+	a.mindist = mindist;
+	a.cdf = cdf;
+	kpool_run_chunks(chunks->threads, pc, KCHUNK_POINTS, d2_chunk, &a);
+
+	double total = 0.0;
+	for (int c = 0; c < chunks->count; c++)
+		total += chunks->totals[c];
+	return total;
+}
+
+/// <summary>
+/// choose_weighted_index() over the per-chunk cdf from d2_round_chunked():
+/// find the chunk holding target from the chunk totals, then search inside it
+/// </summary>
+int choose_weighted_chunked(KChunks* chunks, double* cdf, int pc, double target)
+{
+	if (chunks == NULL)
+		return choose_weighted_index(cdf, pc, target);
+
+	int c = 0;
+	double start = 0.0;
+	while (c < chunks->count - 1 && start + chunks->totals[c] <= target)
+	{
+		start += chunks->totals[c];
+		c++;
+	}
+	// Rounding can run past the last weighted chunk
+	while (c > 0 && chunks->totals[c] == 0.0)
+	{
+		c--;
+		start -= chunks->totals[c];
+	}
+
+	int begin = c * KCHUNK_POINTS;
+	int end = pc - begin > KCHUNK_POINTS ? begin + KCHUNK_POINTS : pc;
+	return begin + choose_weighted_index(cdf + begin, end - begin, target - start);
+}
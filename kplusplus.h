@@ -0,0 +1,233 @@
+#pragma once
+
+#include "timecache.h"
+#include "arrayinput.h"
+#include "krandom.h"
+#include "utils/tuplestore.h"
+
+/**
+* Shared clustering types and helpers
+*
+* Implemented in kplusplus.c, used by the other clustering entry points (fisher.c)
+*/
+
+typedef struct {
+	double average;
+	double min;
+	double max;
+	double stddev;
+	int count;
+} ClusterStats;
+
+// Cluster index of each point: one byte per point while k <= 256, two while k <= 65536, four above.
+// The point values themselves are not copied, kernels read them from the caller's array.
+typedef struct
+{
+	int size;
+	void* data;
+} KLabels;
+
+static inline int klabel(KLabels* labels, int i)
+{
+	switch (labels->size)
+	{
+	case 1:
+		return ((uint8*)labels->data)[i];
+	case 2:
+		return ((uint16*)labels->data)[i];
+	default:
+		return ((int32*)labels->data)[i];
+	}
+}
+
+static inline void set_klabel(KLabels* labels, int i, int j)
+{
+	switch (labels->size)
+	{
+	case 1:
+		((uint8*)labels->data)[i] = (uint8)j;
+		break;
+	case 2:
+		((uint16*)labels->data)[i] = (uint16)j;
+		break;
+	default:
+		((int32*)labels->data)[i] = j;
+		break;
+	}
+}
+
+// Running totals for one cluster, see accumulate_clusters()
+typedef struct
+{
+	int count;
+	double mean;
+	double m2;
+	double min;
+	double max;
+} ClusterAccum;
+
+// Totals of an empty cluster
+static inline void accum_reset(ClusterAccum* a)
+{
+	a->count = 0;
+	a->mean = 0.0;
+	a->m2 = 0.0;
+	a->min = DBL_MAX;
+	a->max = -DBL_MAX;
+}
+
+// One Welford step, see accumulate_clusters()
+static inline void accum_add(ClusterAccum* a, double val)
+{
+	a->count++;
+	double delta = val - a->mean;
+	a->mean += delta / a->count;
+	a->m2 += delta * (val - a->mean);
+	if (val < a->min)
+		a->min = val;
+	if (val > a->max)
+		a->max = val;
+}
+
+// Histogram bin of a value in [lo, lo + bins / scale], see kbinned.c. The top edge goes in the last bin.
+static inline int kbin_index(double val, double lo, double scale, int bins)
+{
+	int b = (int)((val - lo) * scale);
+	return b < bins ? b : bins - 1;
+}
+
+// Backend-local counters for the clustering kernels, see kplusplus_instrumentation()
+typedef struct
+{
+	int64 calls;
+	int64 restarts;
+	int64 iterations;
+	int64 points_evaluated;
+	int64 points_skipped;
+	int64 peak_memory; // largest working memory of one call, in bytes
+	int64 compressed_calls;
+	int64 points_compressed;
+	int64 cache_hits;
+	int64 cache_misses;
+	int64 cache_evictions;
+} KInstrumentation;
+
+extern KInstrumentation kinstrumentation;
+
+// Working memory of one clustering call, see kcall_begin()
+typedef struct
+{
+	MemoryContext context;
+	MemoryContext caller;
+} KCall;
+
+void kcall_begin(KCall* call);
+void kcall_end(KCall* call);
+
+typedef struct
+{
+	KLabels labels;
+	ClusterAccum* accum;
+	int count;
+	double score;
+	int k;
+} Cluster;
+
+
+// Per-chunk buffers for the chunked passes in kparallel.c
+typedef struct
+{
+	int threads;
+	int count;
+	int k;
+	ClusterAccum* partials;
+	double* totals;
+	bool* moved;
+} KChunks;
+
+// Candidates kplus_choose_sampled() draws per round, per centroid (the oversampling factor l = 2k of k-means||)
+#define KSEED_OVERSAMPLE 2
+
+extern int kplusplus_bounded_threshold;
+extern int kplusplus_small_limit;
+extern int kplusplus_compress_ratio;
+extern int kplusplus_sample_threshold;
+
+// kpp_minibatch() stops once no centroid moves more than this many standard deviations of the points in a round
+#define KBATCH_TOLERANCE 1e-4
+extern int kplusplus_batch_size;
+
+// Points per chunk, fixed so chunked results don't depend on the number of threads
+#define KCHUNK_POINTS 65536
+
+
+int compare_doubles(const void* a, const void* b);
+int compare_floats(const void* a, const void* b);
+void sort_doubles(double* values, int count);
+void sort_floats(float4* values, int count);
+
+Cluster* new_cluster(int count, int k);
+void free_cluster(Cluster* c);
+void accumulate_clusters(KValues values, KLabels* labels, int pc, ClusterAccum* accum, int k);
+double score_accum(ClusterAccum* accum, int k);
+void fill_cluster_stats(ClusterAccum* accum, ClusterStats* stats);
+
+ClusterStats* get_cluster_stats(Cluster* c, int clusterIndex);
+ClusterStats* get_all_cluster_stats(Cluster* c, int k);
+Tuplestorestate* kmaterialize_begin(FunctionCallInfo fcinfo, TupleDesc* tupDesc);
+void kmaterialize_clusters(Tuplestorestate* tupstore, TupleDesc tupDesc, ClusterStats* stats, int k);
+
+int choose_weighted_index(double* cdf, int pc, double target);
+int choose_unused_index(int pc, int* indices, int used, KRandom* rng);
+bool sort_centroids(double* centroids, int k);
+void klabels_fill(KLabels* labels, int begin, int end, int j);
+bool klabels_refill(KLabels* labels, int begin, int end, int j);
+void label_ranges(KLabels* labels, int begin, int end, int* starts, int k);
+double kvalues_d2_round(KValues values, int begin, int end, double newest, double* mindist, double* cdf);
+void kvalues_accumulate(KValues values, KLabels* labels, int begin, int end, ClusterAccum* accum, int k);
+bool kvalues_assign_sorted(KValues values, KLabels* labels, int begin, int end, double* bounds, int k, bool reassign);
+void compute_boundaries(double* centroids, int k, double* bounds);
+bool kvalues_range(KValues values, int count, double* min, double* max);
+void kvalues_bin(KValues values, int count, double lo, double scale, int bins, int* counts, double* sums);
+void kvalues_accumulate_bins(KValues values, int count, double lo, double scale, int bins, int* bin_cluster, ClusterAccum* accum);
+bool reassign_points_sorted(KLabels* labels, KValues points, int pc, double* centroids, double* bounds, int k);
+void kplus_assign_sorted(KLabels* labels, KValues points, int point_count, double* centroids, double* bounds, int k);
+void kplus_assign_c(KLabels* labels, double* points, int begin, int end, double* centroids, int k);
+void kplus_choose_simple(double* points, int pcount, int* indices, int k, double* centroids);
+
+// kparallel.c
+extern int kplusplus_parallel_threshold;
+
+KChunks* new_kchunks(int pc, int k);
+void merge_accum(ClusterAccum* into, ClusterAccum* from);
+void free_kchunks(KChunks* chunks);
+void accumulate_clusters_chunked(KChunks* chunks, KValues values, KLabels* labels, int pc, ClusterAccum* accum, int k);
+bool assign_sorted_chunked(KChunks* chunks, KLabels* labels, KValues values, int pc, double* centroids, double* bounds, int k, bool reassign);
+void assign_scan_chunked(KChunks* chunks, KLabels* labels, double* arr, int pc, double* centroids, int k);
+void label_ranges_chunked(KChunks* chunks, KLabels* labels, int pc, int* starts, int k);
+double d2_round_chunked(KChunks* chunks, KValues points, int pc, double newest, double* mindist, double* cdf);
+int choose_weighted_chunked(KChunks* chunks, double* cdf, int pc, double target);
+
+// Clustering entry points of the SQL functions, also run by bench/kbench.c
+Cluster* internal_kplusplus(KValues values, int count, int k, int seeds, int updates, uint64 seed);
+Cluster* internal_ksimple(double* values, int count, int k);
+Cluster* internal_kdynamic(double* values, int count, double threshold);
+int* getKIndices(double* parr, int np, double perc, int sdevs);
+ClusterStats* kplusplus_cluster_stats(FunctionCallInfo fcinfo, int seed_argno, ArrayType* arr, Oid valueType, int count, int k, int seeds, int updates);
+ClusterStats* ksimple_cluster_stats(ArrayType* arr, Oid valueType, int count, int k);
+
+// arrays.c
+int* kbig(double* points, int pc, int num);
+
+// fisher.c
+ClusterAccum* internal_kexact_weighted(ClusterAccum* points, int count, int k);
+
+// kweighted.c
+int compare_weighted_points(const void* a, const void* b);
+int merge_equal_points(ClusterAccum* points, int count);
+int collapse_weighted_points(ClusterAccum* points, int count);
+ClusterAccum* get_weighted_points(ArrayType* values, ArrayType* weights, const char* name, int* count);
+bool kweighted_choose(double* means, double* weights, int pc, int* indices, int k, double* centroids, double* mindist, double* cdf, KRandom* rng);
+ClusterAccum* kplusplus_weighted_restarts(ClusterAccum* points, int pc, int k, int seeds, int updates, uint64 seed);
+ClusterAccum* internal_kplusplus_weighted(ClusterAccum* points, int pc, int k, int seeds, int updates, uint64 seed);
+ClusterAccum* internal_ksimple_weighted(ClusterAccum* points, int pc, int k);
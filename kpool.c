@@ -0,0 +1,155 @@
+#include "kpool.h"
+#include "port/atomics.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <signal.h>
+#endif
+
+/**
+* kpool_run() starts the extra workers for one call and joins them before returning,
+* so no thread ever outlives the call that needed it.
+*/
+
+int kplusplus_threads = 1;
+
+typedef struct
+{
+	KPoolTask task;
+	void* arg;
+	int worker;
+} KPoolWorker;
+
+#ifdef _WIN32
+static DWORD WINAPI kpool_thread(LPVOID p)
+{
+	KPoolWorker* w = (KPoolWorker*)p;
+	w->task(w->arg, w->worker);
+	return 0;
+}
+#else
+static void* kpool_thread(void* p)
+{
+	KPoolWorker* w = (KPoolWorker*)p;
+	w->task(w->arg, w->worker);
+	return NULL;
+}
+#endif
+
+/// <summary>
+/// Run task on threads workers and wait for all of them.
+/// If a thread can't be started its share runs on the calling thread instead, so the task
+/// always sees every worker index exactly once.
+/// </summary>
+/// <returns>number of workers that ran on their own thread, plus the caller</returns>
+int kpool_run(int threads, KPoolTask task, void* arg)
+{
+	if (threads > KPOOL_MAX_THREADS)
+		threads = KPOOL_MAX_THREADS;
+	if (threads <= 1)
+	{
+		task(arg, 0);
+		return 1;
+	}
+
+	KPoolWorker workers[KPOOL_MAX_THREADS];
+	bool started[KPOOL_MAX_THREADS];
+#ifdef _WIN32
+	HANDLE handles[KPOOL_MAX_THREADS];
+#else
+	pthread_t handles[KPOOL_MAX_THREADS];
+	sigset_t blocked;
+	sigset_t previous;
+
+	// Signals belong to the backend: workers start with all of them blocked
+	sigfillset(&blocked);
+	pthread_sigmask(SIG_SETMASK, &blocked, &previous);
+#endif
+
+	int running = 1;
+	for (int i = 1; i < threads; i++)
+	{
+		workers[i].task = task;
+		workers[i].arg = arg;
+		workers[i].worker = i;
+#ifdef _WIN32
+		handles[i] = CreateThread(NULL, 0, kpool_thread, &workers[i], 0, NULL);
+		started[i] = handles[i] != NULL;
+#else
+		started[i] = pthread_create(&handles[i], NULL, kpool_thread, &workers[i]) == 0;
+#endif
+		if (started[i])
+			running++;
+	}
+
+#ifndef _WIN32
+	pthread_sigmask(SIG_SETMASK, &previous, NULL);
+#endif
+
+	task(arg, 0);
+	for (int i = 1; i < threads; i++)
+	{
+		if (!started[i])
+			task(arg, i);
+	}
+
+	for (int i = 1; i < threads; i++)
+	{
+		if (!started[i])
+			continue;
+#ifdef _WIN32
+		WaitForSingleObject(handles[i], INFINITE);
+		CloseHandle(handles[i]);
+#else
+		pthread_join(handles[i], NULL);
+#endif
+	}
+	return running;
+}
+
+typedef struct
+{
+	KChunkTask task;
+	void* arg;
+	int count;
+	int chunk_size;
+	int chunks;
+	pg_atomic_uint32 next_chunk;
+} KPoolChunks;
+
+static void kpool_chunk_worker(void* arg, int worker)
+{
+	KPoolChunks* job = (KPoolChunks*)arg;
+	for (;;)
+	{
+		uint32 chunk = pg_atomic_fetch_add_u32(&job->next_chunk, 1);
+		if (chunk >= (uint32)job->chunks)
+			break;
+
+		int begin = (int)chunk * job->chunk_size;
+		int end = job->count - begin > job->chunk_size ? begin + job->chunk_size : job->count;
+		job->task(job->arg, (int)chunk, begin, end);
+	}
+}
+
+/// <summary>
+/// Split [0, count) into chunk_size pieces and run task on each, spread over threads workers.
+/// Chunks depend only on count and chunk_size, so per-chunk results merged in chunk order
+/// are the same for any number of threads.
+/// </summary>
+void kpool_run_chunks(int threads, int count, int chunk_size, KChunkTask task, void* arg)
+{
+	KPoolChunks job;
+	job.task = task;
+	job.arg = arg;
+	job.count = count;
+	job.chunk_size = chunk_size;
+	job.chunks = (count + chunk_size - 1) / chunk_size;
+	pg_atomic_init_u32(&job.next_chunk, 0);
+
+	if (threads > job.chunks)
+		threads = job.chunks;
+	kpool_run(threads, kpool_chunk_worker, &job);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "timecache.h"
+
+/**
+* Worker threads for the clustering kernels
+*
+* Tasks run outside the backend's control: they must not palloc, ereport, or touch
+* any other backend state. Everything a task needs is allocated by the caller beforehand,
+* and failures are recorded in the task's own state for the caller to report.
+*/
+
+// Upper limit for timecache.kplusplus_threads
+#define KPOOL_MAX_THREADS 64
+
+// Called once per worker, worker is in [0, threads). Worker 0 runs on the calling thread.
+typedef void (*KPoolTask)(void* arg, int worker);
+
+// Called for each chunk [begin, end) of a kpool_run_chunks() range
+typedef void (*KChunkTask)(void* arg, int chunk, int begin, int end);
+
+// timecache.kplusplus_threads
+extern int kplusplus_threads;
+
+int kpool_run(int threads, KPoolTask task, void* arg);
+void kpool_run_chunks(int threads, int count, int chunk_size, KChunkTask task, void* arg);
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "timecache.h"
+
+/**
+* Small, fast PRNG (xoshiro256**) for the clustering restarts
+*
+* Unlike rand() the state is explicit, so every call (and every restart) can own a generator:
+* a given seed gives the same result on any thread, in any order, and in any backend.
+*
+* https://prng.di.unimi.it/
+*/
+
+typedef struct
+{
+	uint64 s[4];
+} KRandom;
+
+static inline uint64 krandom_splitmix64(uint64* x)
+{
+	uint64 z = (*x += UINT64CONST(0x9E3779B97F4A7C15));
+	z = (z ^ (z >> 30)) * UINT64CONST(0xBF58476D1CE4E5B9);
+	z = (z ^ (z >> 27)) * UINT64CONST(0x94D049BB133111EB);
+	return z ^ (z >> 31);
+}
+
+/// <summary>
+/// Seed the generator for one stream of a seed, e.g. one restart.
+/// Streams of the same seed are independent of each other.
+/// </summary>
+static inline void krandom_seed(KRandom* r, uint64 seed, uint64 stream)
+{
+	uint64 x = seed ^ krandom_splitmix64(&stream);
+	for (int i = 0; i < 4; i++)
+		r->s[i] = krandom_splitmix64(&x);
+}
+
+static inline uint64 krandom_rotl(uint64 x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64 krandom_next(KRandom* r)
+{
+	uint64* s = r->s;
+	uint64 result = krandom_rotl(s[1] * 5, 7) * 9;
+	uint64 t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = krandom_rotl(s[3], 45);
+
+	return result;
+}
+
+/// <summary>
+/// Random double in [0, 1), 53 bits
+/// </summary>
+static inline double krandom_unit(KRandom* r)
+{
+	return (krandom_next(r) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/// <summary>
+/// Random index in [0, n)
+/// </summary>
+static inline int krandom_index(KRandom* r, int n)
+{
+	return (int)(krandom_unit(r) * n);
+}
+
+/// <summary>
+/// A fresh random seed, for calls not given one
+/// </summary>
+static inline uint64 krandom_fresh_seed(void)
+{
+	uint64 seed;
+	if (!pg_strong_random(&seed, sizeof(seed)))
+		seed = (uint64)GetCurrentTimestamp();
+	return seed;
+}
+
+/// <summary>
+/// The seed for a SQL function's optional bigint seed argument at argno:
+/// the given value, or a fresh random seed when it is missing or NULL
+/// </summary>
+static inline uint64 krandom_seed_arg(FunctionCallInfo fcinfo, int argno)
+{
+	if (PG_NARGS() > argno && !PG_ARGISNULL(argno))
+		return (uint64)PG_GETARG_INT64(argno);
+	return krandom_fresh_seed();
+}
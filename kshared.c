@@ -0,0 +1,681 @@
+#include "kshared.h"
+#include "krandom.h"
+#include "lib/dshash.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/dsa.h"
+
+/**
+* Result cache shared by every backend
+*
+* kcache.c keeps results per backend, so a hundred pooled connections clustering the same series
+* compute it a hundred times. With the library in shared_preload_libraries, results are also kept in
+* a dshash table in a DSA area, under the same KCacheTag, and any backend's hit saves the others the work.
+*
+*   timecache.kplusplus_shared_cache_size - budget in kB, 0 disables the shared cache. Reloadable.
+*   timecache.kplusplus_shared_cache_ttl  - seconds a result is served after it was stored, 0 forever. Reloadable.
+*
+* Lookups only take the lock of the table partition the tag hashes to, so hits in different backends
+* don't wait on each other. Stores, eviction and the SQL functions below also take kshared->lock, which
+* guards the list of entries: the PG14 dshash has no sequential scan. Lock order is kshared->lock, then a partition.
+*
+* Eviction is a clock sweep from the oldest entry: expired entries are dropped, entries read since the
+* hand last passed them get a second chance at the head, and the others are dropped until the new result fits.
+*
+* kplusplus_cache_stats() / the kplusplus_cache view - hit ratio and memory of this backend's cache and the shared one
+* kplusplus_cache_entries() - every shared entry, with its series label, hits and age
+* kplusplus_cache_invalidate([series]) - drop the shared entries of one series, or every entry and this backend's cache
+* kplusplus_cache_prewarm(series, points, k, seeds, updates, seed) - store a kplusplus result under a series label
+*
+* Entries are keyed by the array's hash and arguments like the backend cache, the series label is only
+* a name to inspect and invalidate them by: prewarming a series with the array a dashboard will send
+* makes its first kplusplus call a hit in every backend.
+*/
+
+PGDLLEXPORT Datum kplusplus_cache_stats(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum kplusplus_cache_entries(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum kplusplus_cache_invalidate(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum kplusplus_cache_prewarm(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(kplusplus_cache_stats);
+PG_FUNCTION_INFO_V1(kplusplus_cache_entries);
+PG_FUNCTION_INFO_V1(kplusplus_cache_invalidate);
+PG_FUNCTION_INFO_V1(kplusplus_cache_prewarm);
+
+// Shared cache budget in kB, 0 disables it. Set by timecache.kplusplus_shared_cache_size
+int kplusplus_shared_cache_size = 65536;
+// Seconds a shared result is served for, 0 forever. Set by timecache.kplusplus_shared_cache_ttl
+int kplusplus_shared_cache_ttl = 0;
+
+// In the main shared memory segment
+typedef struct
+{
+	LWLock* lock; // guards everything below but the counters, and every block's list links
+	int tranche; // of the area and the table's partition locks
+	bool created; // area and table are valid
+	dsa_handle area;
+	dshash_table_handle table;
+	dsa_pointer head; // KSharedBlock most recently stored or given a second chance
+	dsa_pointer tail; // next one the clock hand looks at
+	Size used; // bytes of every block
+	int64 entries;
+	pg_atomic_uint64 hits;
+	pg_atomic_uint64 misses;
+	pg_atomic_uint64 evictions;
+	pg_atomic_uint64 expirations;
+} KSharedState;
+
+// Table entry
+typedef struct
+{
+	KCacheTag tag; // hash key, must be first
+	dsa_pointer block;
+} KSharedEntry;
+
+// One result, followed by the stats of its tag.k clusters and then the array's elements
+typedef struct
+{
+	dsa_pointer prev;
+	dsa_pointer next;
+	KCacheTag tag;
+	char series[NAMEDATALEN]; // empty unless stored by kplusplus_cache_prewarm()
+	TimestampTz stored;
+	pg_atomic_uint32 referenced; // read since the clock hand last passed
+	pg_atomic_uint64 hits;
+	Size size; // bytes charged to the budget
+	Size nbytes;
+} KSharedBlock;
+
+#define KSHARED_STATS(block) ((ClusterStats*)((char*)(block) + MAXALIGN(sizeof(KSharedBlock))))
+#define KSHARED_DATA(block) ((char*)KSHARED_STATS(block) + MAXALIGN(sizeof(ClusterStats) * (block)->tag.k))
+
+static KSharedState* kshared = NULL;
+static dsa_area* kshared_area = NULL;
+static dshash_table* kshared_table = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+
+// By name: PG17 added copy_function ahead of tranche_id
+static dshash_parameters kshared_params = {
+	.key_size = sizeof(KCacheTag),
+	.entry_size = sizeof(KSharedEntry),
+	.compare_function = dshash_memcmp,
+	.hash_function = dshash_memhash,
+#if PG_VERSION_NUM >= 170000
+	.copy_function = dshash_memcpy,
+#endif
+	.tranche_id = 0 // set from kshared->tranche
+};
+
+static Size kshared_budget(void)
+{
+	return (Size)kplusplus_shared_cache_size * 1024;
+}
+
+/// <summary>
+/// Find or create the shared state, once in the postmaster and in each EXEC_BACKEND child
+/// </summary>
+static void kshared_startup(void)
+{
+	if (prev_shmem_startup_hook != NULL)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	bool found;
+	kshared = ShmemInitStruct("TimeCachePGExtensions result cache", sizeof(KSharedState), &found);
+	if (!found)
+	{
+		memset(kshared, 0, sizeof(KSharedState));
+		kshared->lock = &(GetNamedLWLockTranche("TimeCachePGExtensions"))->lock;
+		kshared->tranche = LWLockNewTrancheId();
+		kshared->head = InvalidDsaPointer;
+		kshared->tail = InvalidDsaPointer;
+		pg_atomic_init_u64(&kshared->hits, 0);
+		pg_atomic_init_u64(&kshared->misses, 0);
+		pg_atomic_init_u64(&kshared->evictions, 0);
+		pg_atomic_init_u64(&kshared->expirations, 0);
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/// <summary>
+/// Ask the postmaster for the shared state's memory and lock
+/// </summary>
+static void kshared_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (prev_shmem_request_hook != NULL)
+		prev_shmem_request_hook();
+#endif
+
+	RequestAddinShmemSpace(MAXALIGN(sizeof(KSharedState)));
+	RequestNamedLWLockTranche("TimeCachePGExtensions", 1);
+}
+
+/// <summary>
+/// Reserve the shared state when loaded by shared_preload_libraries, called by _PG_init().
+/// From PG15 the requests are only allowed from shmem_request_hook.
+/// </summary>
+void kshared_init(void)
+{
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = kshared_request;
+#else
+	kshared_request();
+#endif
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = kshared_startup;
+}
+
+/// <summary>
+/// True if results should also be kept in the shared cache
+/// </summary>
+bool kshared_enabled(void)
+{
+	return kshared != NULL && kplusplus_shared_cache_size > 0;
+}
+
+/// <summary>
+/// Map the area and table in this backend, creating them on first use anywhere
+/// </summary>
+static void kshared_attach(void)
+{
+	if (kshared_table != NULL)
+		return;
+
+	LWLockRegisterTranche(kshared->tranche, "timecache_cache");
+	kshared_params.tranche_id = kshared->tranche;
+
+	// Both stay mapped until the backend exits
+	MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	LWLockAcquire(kshared->lock, LW_EXCLUSIVE);
+
+	if (!kshared->created)
+	{
+		kshared_area = dsa_create(kshared->tranche);
+		dsa_pin(kshared_area);
+		dsa_pin_mapping(kshared_area);
+		kshared_table = dshash_create(kshared_area, &kshared_params, NULL);
+
+		kshared->area = dsa_get_handle(kshared_area);
+		kshared->table = dshash_get_hash_table_handle(kshared_table);
+		kshared->created = true;
+	}
+	else
+	{
+		kshared_area = dsa_attach(kshared->area);
+		dsa_pin_mapping(kshared_area);
+		kshared_table = dshash_attach(kshared_area, &kshared_params, kshared->table, NULL);
+	}
+
+	LWLockRelease(kshared->lock);
+	MemoryContextSwitchTo(oldcontext);
+}
+
+static KSharedBlock* kshared_block(dsa_pointer dp)
+{
+	return (KSharedBlock*)dsa_get_address(kshared_area, dp);
+}
+
+static bool kshared_expired(KSharedBlock* block, TimestampTz now)
+{
+	return kplusplus_shared_cache_ttl > 0 && TimestampDifferenceExceeds(block->stored, now, kplusplus_shared_cache_ttl * 1000);
+}
+
+/// <summary>
+/// Take block out of the list. Caller holds kshared->lock exclusively
+/// </summary>
+static void kshared_unlink(KSharedBlock* block)
+{
+	if (DsaPointerIsValid(block->prev))
+		kshared_block(block->prev)->next = block->next;
+	else
+		kshared->head = block->next;
+
+	if (DsaPointerIsValid(block->next))
+		kshared_block(block->next)->prev = block->prev;
+	else
+		kshared->tail = block->prev;
+}
+
+/// <summary>
+/// Put block dp at the head of the list. Caller holds kshared->lock exclusively
+/// </summary>
+static void kshared_push_head(dsa_pointer dp, KSharedBlock* block)
+{
+	block->prev = InvalidDsaPointer;
+	block->next = kshared->head;
+	if (DsaPointerIsValid(kshared->head))
+		kshared_block(kshared->head)->prev = dp;
+	else
+		kshared->tail = dp;
+	kshared->head = dp;
+}
+
+/// <summary>
+/// Remove block dp from the table and the list and free it. Caller holds kshared->lock exclusively
+/// </summary>
+static void kshared_drop(dsa_pointer dp)
+{
+	KSharedBlock* block = kshared_block(dp);
+
+	// Waits for lookups reading the block to finish
+	KSharedEntry* entry = dshash_find(kshared_table, &block->tag, true);
+	if (entry != NULL)
+		dshash_delete_entry(kshared_table, entry);
+
+	kshared_unlink(block);
+	kshared->used -= block->size;
+	kshared->entries--;
+	dsa_free(kshared_area, dp);
+}
+
+/// <summary>
+/// Clock sweep until size more bytes fit in the budget, see the top of this file. Caller holds kshared->lock exclusively
+/// </summary>
+static void kshared_sweep(Size size, TimestampTz now)
+{
+	while (kshared->used + size > kshared_budget() && DsaPointerIsValid(kshared->tail))
+	{
+		dsa_pointer dp = kshared->tail;
+		KSharedBlock* block = kshared_block(dp);
+		bool expired = kshared_expired(block, now);
+
+		if (!expired && pg_atomic_exchange_u32(&block->referenced, 0) != 0)
+		{
+			kshared_unlink(block);
+			kshared_push_head(dp, block);
+			continue;
+		}
+
+		kshared_drop(dp);
+		pg_atomic_fetch_add_u64(expired ? &kshared->expirations : &kshared->evictions, 1);
+	}
+}
+
+/// <summary>
+/// The shared stats for tag, if arr is the array they were computed from and they haven't expired
+/// </summary>
+/// <returns>a copy of the stats of all tag->k clusters in the current context, or NULL on a miss</returns>
+ClusterStats* kshared_lookup(KCacheTag* tag, ArrayType* arr)
+{
+	kshared_attach();
+
+	Size nbytes = kcache_array_bytes(arr);
+	ClusterStats* stats = palloc(sizeof(ClusterStats) * tag->k);
+	bool hit = false;
+
+	KSharedEntry* entry = dshash_find(kshared_table, tag, false);
+	if (entry != NULL)
+	{
+		KSharedBlock* block = kshared_block(entry->block);
+		hit = block->nbytes == nbytes && !kshared_expired(block, GetCurrentTimestamp())
+			&& memcmp(KSHARED_DATA(block), ARR_DATA_PTR(arr), nbytes) == 0;
+		if (hit)
+		{
+			memcpy(stats, KSHARED_STATS(block), sizeof(ClusterStats) * tag->k);
+			pg_atomic_write_u32(&block->referenced, 1);
+			pg_atomic_fetch_add_u64(&block->hits, 1);
+		}
+		dshash_release_lock(kshared_table, entry);
+	}
+
+	if (!hit)
+	{
+		pg_atomic_fetch_add_u64(&kshared->misses, 1);
+		pfree(stats);
+		return NULL;
+	}
+	pg_atomic_fetch_add_u64(&kshared->hits, 1);
+	return stats;
+}
+
+/// <summary>
+/// Share the stats of all tag->k clusters computed from arr, replacing any result stored under tag
+/// and evicting others to make room. Results larger than the whole budget are not kept.
+/// </summary>
+/// <param name="series">label for kplusplus_cache_entries() and kplusplus_cache_invalidate(), or NULL</param>
+/// <returns>true if stored</returns>
+bool kshared_store(KCacheTag* tag, ArrayType* arr, ClusterStats* stats, const char* series)
+{
+	Size nbytes = kcache_array_bytes(arr);
+	Size size = MAXALIGN(sizeof(KSharedBlock)) + MAXALIGN(sizeof(ClusterStats) * tag->k) + nbytes;
+	if (size > kshared_budget())
+		return false;
+
+	kshared_attach();
+	TimestampTz now = GetCurrentTimestamp();
+
+	LWLockAcquire(kshared->lock, LW_EXCLUSIVE);
+
+	// Stored by another backend meanwhile, or expired: the new result replaces it
+	KSharedEntry* entry = dshash_find(kshared_table, tag, false);
+	if (entry != NULL)
+	{
+		dsa_pointer old = entry->block;
+		dshash_release_lock(kshared_table, entry);
+		kshared_drop(old);
+	}
+
+	kshared_sweep(size, now);
+
+	// Entry first, so an error growing the table can't leak a block. Nobody sees it before it is filled
+	bool found;
+	entry = dshash_find_or_insert(kshared_table, tag, &found);
+	dsa_pointer dp = dsa_allocate_extended(kshared_area, size, DSA_ALLOC_NO_OOM);
+	if (!DsaPointerIsValid(dp))
+	{
+		dshash_delete_entry(kshared_table, entry);
+		LWLockRelease(kshared->lock);
+		return false;
+	}
+
+	KSharedBlock* block = kshared_block(dp);
+	block->tag = *tag;
+	strlcpy(block->series, series != NULL ? series : "", NAMEDATALEN);
+	block->stored = now;
+	pg_atomic_init_u32(&block->referenced, 0);
+	pg_atomic_init_u64(&block->hits, 0);
+	block->size = size;
+	block->nbytes = nbytes;
+	memcpy(KSHARED_STATS(block), stats, sizeof(ClusterStats) * tag->k);
+	memcpy(KSHARED_DATA(block), ARR_DATA_PTR(arr), nbytes);
+
+	entry->block = dp;
+	dshash_release_lock(kshared_table, entry);
+
+	kshared_push_head(dp, block);
+	kshared->used += size;
+	kshared->entries++;
+
+	LWLockRelease(kshared->lock);
+	return true;
+}
+
+// One row of kplusplus_cache_stats()
+typedef struct
+{
+	const char* cache;
+	int64 entries;
+	int64 hits;
+	int64 misses;
+	int64 evictions;
+	int64 expirations;
+	int64 memory;
+	int64 memory_limit;
+} KCacheStatsRow;
+
+/// <summary>
+/// One row for this backend's cache and, when loaded by shared_preload_libraries, one for the shared cache:
+/// entries, hits, misses, hit_ratio (NULL before the first lookup), evictions, expirations and bytes in use and allowed.
+/// The kplusplus_cache view selects from this.
+/// </summary>
+Datum kplusplus_cache_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc tupDesc;
+
+	if (get_call_result_type(fcinfo, NULL, &tupDesc) != TYPEFUNC_COMPOSITE)
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("function returning record called in context that cannot accept type record")));
+	}
+
+	FuncCallContext* funcctx;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		funcctx = SRF_FIRSTCALL_INIT();
+
+		MemoryContext oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		// Snapshot, so the rows are consistent with each other
+		KCacheStatsRow* rows = palloc0(sizeof(KCacheStatsRow) * 2);
+		rows[0].cache = "local";
+		rows[0].entries = kcache_entries();
+		rows[0].hits = kinstrumentation.cache_hits;
+		rows[0].misses = kinstrumentation.cache_misses;
+		rows[0].evictions = kinstrumentation.cache_evictions;
+		rows[0].memory = kcache_memory();
+		rows[0].memory_limit = (int64)kplusplus_cache_size * 1024;
+		funcctx->max_calls = 1;
+
+		if (kshared != NULL)
+		{
+			rows[1].cache = "shared";
+			LWLockAcquire(kshared->lock, LW_SHARED);
+			rows[1].entries = kshared->entries;
+			rows[1].memory = kshared->used;
+			LWLockRelease(kshared->lock);
+			rows[1].hits = pg_atomic_read_u64(&kshared->hits);
+			rows[1].misses = pg_atomic_read_u64(&kshared->misses);
+			rows[1].evictions = pg_atomic_read_u64(&kshared->evictions);
+			rows[1].expirations = pg_atomic_read_u64(&kshared->expirations);
+			rows[1].memory_limit = kshared_budget();
+			funcctx->max_calls = 2;
+		}
+
+		funcctx->user_fctx = rows;
+		funcctx->tuple_desc = BlessTupleDesc(tupDesc);
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		KCacheStatsRow* row = &((KCacheStatsRow*)funcctx->user_fctx)[funcctx->call_cntr];
+		bool isnull[9] = { false, false, false, false, false, false, false, false, false };
+		Datum retDat[9];
+
+		int64 lookups = row->hits + row->misses;
+		retDat[0] = CStringGetTextDatum(row->cache);
+		retDat[1] = Int64GetDatum(row->entries);
+		retDat[2] = Int64GetDatum(row->hits);
+		retDat[3] = Int64GetDatum(row->misses);
+		retDat[4] = Float8GetDatum(lookups > 0 ? (double)row->hits / lookups : 0);
+		isnull[4] = lookups == 0;
+		retDat[5] = Int64GetDatum(row->evictions);
+		retDat[6] = Int64GetDatum(row->expirations);
+		retDat[7] = Int64GetDatum(row->memory);
+		retDat[8] = Int64GetDatum(row->memory_limit);
+
+		HeapTuple ht = heap_form_tuple(funcctx->tuple_desc, retDat, isnull);
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(ht));
+	}
+	else
+	{
+		SRF_RETURN_DONE(funcctx);
+	}
+}
+
+// One row of kplusplus_cache_entries()
+typedef struct
+{
+	KCacheTag tag;
+	char series[NAMEDATALEN];
+	int64 hits;
+	int64 bytes;
+	TimestampTz stored;
+} KCacheEntryRow;
+
+/// <summary>
+/// Every entry of the shared cache, most recently stored or read first: series label (NULL if none),
+/// function, points, k, seeds, updates and seed (NULL for ksimple), hits, bytes and when it was stored.
+/// No rows unless loaded by shared_preload_libraries.
+/// </summary>
+Datum kplusplus_cache_entries(PG_FUNCTION_ARGS)
+{
+	TupleDesc tupDesc;
+
+	if (get_call_result_type(fcinfo, NULL, &tupDesc) != TYPEFUNC_COMPOSITE)
+	{
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("function returning record called in context that cannot accept type record")));
+	}
+
+	FuncCallContext* funcctx;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		funcctx = SRF_FIRSTCALL_INIT();
+
+		MemoryContext oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		KCacheEntryRow* rows = NULL;
+		int count = 0;
+		if (kshared != NULL)
+		{
+			kshared_attach();
+			LWLockAcquire(kshared->lock, LW_SHARED);
+			rows = palloc(sizeof(KCacheEntryRow) * Max(kshared->entries, 1));
+			for (dsa_pointer dp = kshared->head; DsaPointerIsValid(dp); dp = kshared_block(dp)->next)
+			{
+				KSharedBlock* block = kshared_block(dp);
+				rows[count].tag = block->tag;
+				memcpy(rows[count].series, block->series, NAMEDATALEN);
+				rows[count].hits = pg_atomic_read_u64(&block->hits);
+				rows[count].bytes = block->size;
+				rows[count].stored = block->stored;
+				count++;
+			}
+			LWLockRelease(kshared->lock);
+		}
+
+		funcctx->user_fctx = rows;
+		funcctx->max_calls = count;
+		funcctx->tuple_desc = BlessTupleDesc(tupDesc);
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		KCacheEntryRow* row = &((KCacheEntryRow*)funcctx->user_fctx)[funcctx->call_cntr];
+		bool kpp = row->tag.kind == KCACHE_KPLUSPLUS;
+		bool isnull[10] = { row->series[0] == '\0', false, false, false, !kpp, !kpp, !kpp, false, false, false };
+		Datum retDat[10];
+
+		retDat[0] = CStringGetTextDatum(row->series);
+		retDat[1] = CStringGetTextDatum(kpp ? "kplusplus" : "ksimple");
+		retDat[2] = Int32GetDatum(row->tag.count);
+		retDat[3] = Int32GetDatum(row->tag.k);
+		retDat[4] = Int32GetDatum(row->tag.seeds);
+		retDat[5] = Int32GetDatum(row->tag.updates);
+		retDat[6] = Int64GetDatum((int64)row->tag.seed);
+		retDat[7] = Int64GetDatum(row->hits);
+		retDat[8] = Int64GetDatum(row->bytes);
+		retDat[9] = TimestampTzGetDatum(row->stored);
+
+		HeapTuple ht = heap_form_tuple(funcctx->tuple_desc, retDat, isnull);
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(ht));
+	}
+	else
+	{
+		SRF_RETURN_DONE(funcctx);
+	}
+}
+
+/// <summary>
+/// kplusplus_cache_invalidate(series) drops the shared entries prewarmed under series.
+/// kplusplus_cache_invalidate() drops every shared entry and this backend's cache, other backends keep theirs.
+/// </summary>
+/// <returns>number of shared entries dropped</returns>
+Datum kplusplus_cache_invalidate(PG_FUNCTION_ARGS)
+{
+	char* series = PG_NARGS() > 0 && !PG_ARGISNULL(0) ? text_to_cstring(PG_GETARG_TEXT_PP(0)) : NULL;
+	int64 dropped = 0;
+
+	if (series == NULL)
+		kcache_clear();
+
+	if (kshared != NULL)
+	{
+		kshared_attach();
+		LWLockAcquire(kshared->lock, LW_EXCLUSIVE);
+		dsa_pointer dp = kshared->head;
+		while (DsaPointerIsValid(dp))
+		{
+			KSharedBlock* block = kshared_block(dp);
+			dsa_pointer next = block->next;
+			if (series == NULL || strncmp(block->series, series, NAMEDATALEN - 1) == 0)
+			{
+				kshared_drop(dp);
+				dropped++;
+			}
+			dp = next;
+		}
+		LWLockRelease(kshared->lock);
+	}
+
+	PG_RETURN_INT64(dropped);
+}
+
+/// <summary>
+/// kplusplus_cache_prewarm(series, points, k, seeds, updates, seed): run kplusplus and share its result
+/// under the series label, so the first kplusplus, kplusplus_all, knear or knear_avg call with the same
+/// points and arguments is a hit in every backend. The series label is cut to NAMEDATALEN - 1 bytes.
+/// </summary>
+/// <returns>false if the shared cache is disabled or the result doesn't fit in it</returns>
+Datum kplusplus_cache_prewarm(PG_FUNCTION_ARGS)
+{
+	if (kshared == NULL)
+		ereport(ERROR, errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE), errmsg("kplusplus_cache_prewarm requires TimeCachePGExtensions in shared_preload_libraries."));
+	if (PG_NARGS() < 6)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kplusplus_cache_prewarm requires six arguments: series,points,k,seeds,updates,seed."));
+	for (int i = 0; i < 6; i++)
+	{
+		if (PG_ARGISNULL(i))
+			ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kplusplus_cache_prewarm called with NULL argument %d, only seeded kplusplus calls are cached.", i + 1));
+	}
+
+	char* series = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	ArrayType* arr = PG_GETARG_ARRAYTYPE_P(1);
+	if (ARR_NDIM(arr) != 1)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kplusplus_cache_prewarm only supports 1-dimensional arrays."));
+	Oid valueType = ARR_ELEMTYPE(arr);
+	if (valueType != FLOAT4OID && valueType != FLOAT8OID && valueType != INT8OID && valueType != INT4OID)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kplusplus_cache_prewarm supports only integer/float 4/8 types."));
+
+	int array_length = (ARR_DIMS(arr))[0];
+	if (array_length < 1)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kplusplus_cache_prewarm empty array."));
+	int k = PG_GETARG_INT32(2);
+	if (k < 1)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kplusplus_cache_prewarm k must be >= 1, given: %d", k));
+	if (k > array_length)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kplusplus_cache_prewarm array length %d less than k: %d", array_length, k));
+	// Clamped as kplusplus does, so the tags match
+	int seeds = PG_GETARG_INT32(3);
+	if (seeds < 1)
+		seeds = 1;
+	int updates = PG_GETARG_INT32(4);
+	if (updates < 1)
+		updates = 1;
+	uint64 seed = krandom_seed_arg(fcinfo, 5);
+
+	if (!kshared_enabled())
+		PG_RETURN_BOOL(false);
+
+	KValues values = get_array_values(arr, valueType, array_length);
+	Cluster* best = internal_kplusplus(values, array_length, k, seeds, updates, seed);
+	free_array_values(arr, values);
+
+	ClusterStats* stats = get_all_cluster_stats(best, k);
+	free_cluster(best);
+
+	KCacheTag tag;
+	bool stored = kcache_tag(&tag, KCACHE_KPLUSPLUS, arr, k, seeds, updates, seed) && kshared_store(&tag, arr, stats, series);
+
+	pfree(stats);
+	PG_RETURN_BOOL(stored);
+}
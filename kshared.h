@@ -0,0 +1,15 @@
+#pragma once
+
+#include "kcache.h"
+
+/**
+* Result cache shared by every backend, see kshared.c
+*/
+
+extern int kplusplus_shared_cache_size;
+extern int kplusplus_shared_cache_ttl;
+
+void kshared_init(void);
+bool kshared_enabled(void);
+ClusterStats* kshared_lookup(KCacheTag* tag, ArrayType* arr);
+bool kshared_store(KCacheTag* tag, ArrayType* arr, ClusterStats* stats, const char* series);
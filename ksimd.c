@@ -0,0 +1,560 @@
+#include "ksimd.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define KSIMD_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define KSIMD_ARM64 1
+#include <arm_neon.h>
+#endif
+
+// GCC and Clang only emit instructions the function is marked for, MSVC allows any intrinsic anywhere
+#if defined(__GNUC__) || defined(__clang__)
+#define KSIMD_TARGET(t) __attribute__((target(t)))
+#else
+#define KSIMD_TARGET(t)
+#endif
+
+/**
+* SIMD kernels, see ksimd.h
+*
+* Each kernel is the scalar reference with the points spread across lanes:
+* - nearest: |c - v| and a strict less-than per centroid, the label kept in a double lane and converted at the end
+* - d2 rounds: (v - c)^2 and min() into mindist across lanes, then the running total over the lanes in point order.
+*   SSE/AVX min(a, b) is exactly a < b ? a : b, the scalar update.
+* - adjacency: (l - r) / min(l, r) with the zero cases blended in, counted from the compare mask
+* No kernel adds a product, so fused multiply-add contraction can't change results.
+*/
+
+// timecache.kplusplus_simd
+int kplusplus_simd = KSIMD_AUTO;
+
+const struct config_enum_entry ksimd_options[] = {
+	{"auto", KSIMD_AUTO, false},
+	{"scalar", KSIMD_SCALAR, false},
+	{"sse2", KSIMD_SSE2, false},
+	{"avx2", KSIMD_AVX2, false},
+	{"avx512", KSIMD_AVX512, false},
+	{"neon", KSIMD_NEON, false},
+	{NULL, 0, false}
+};
+
+/* Scalar references */
+
+void nearest_scalar(const double* points, int n, const double* centroids, int k, int32* out)
+{
+	for (int i = 0; i < n; i++)
+	{
+		double val = points[i];
+		double dist = fabs(centroids[0] - val);
+		int c = 0;
+		for (int j = 1; j < k; j++)
+		{
+			double nextd = fabs(centroids[j] - val);
+			if (nextd < dist)
+			{
+				c = j;
+				dist = nextd;
+			}
+		}
+		out[i] = c;
+	}
+}
+
+// One scalar D^2 step for point j, continuing the running total
+static inline double d2_step(double v, int j, double newest, double* mindist, double* cdf, double total)
+{
+	double d = v - newest;
+	d = d * d;
+	if (d < mindist[j])
+		mindist[j] = d;
+	total += mindist[j];
+	cdf[j] = total;
+	return total;
+}
+
+static double d2_round_f8_scalar(const double* points, int pc, double newest, double* mindist, double* cdf)
+{
+	double total = 0.0;
+	for (int j = 0; j < pc; j++)
+		total = d2_step(points[j], j, newest, mindist, cdf, total);
+	return total;
+}
+
+static double d2_round_f4_scalar(const float4* points, int pc, double newest, double* mindist, double* cdf)
+{
+	double total = 0.0;
+	for (int j = 0; j < pc; j++)
+		total = d2_step((double)points[j], j, newest, mindist, cdf, total);
+	return total;
+}
+
+int adjacency_count_scalar(const double* values, int n, double threshold)
+{
+	int total = 0;
+	for (int a = 1; a < n; a++)
+	{
+		if (fabs(relative_diff_min(values[a], values[a - 1])) > threshold)
+			total++;
+	}
+	return total;
+}
+
+// Running total over mindist[from, to), continuing from total
+static inline double cdf_run(const double* mindist, double* cdf, int from, int to, double total)
+{
+	for (int j = from; j < to; j++)
+	{
+		total += mindist[j];
+		cdf[j] = total;
+	}
+	return total;
+}
+
+static inline int mask_bits(unsigned int mask)
+{
+	int count = 0;
+	for (; mask != 0; mask &= mask - 1)
+		count++;
+	return count;
+}
+
+#ifdef KSIMD_X86
+
+/* SSE2, always present on x86-64 */
+
+static void nearest_sse2(const double* points, int n, const double* centroids, int k, int32* out)
+{
+	const __m128d sign = _mm_set1_pd(-0.0);
+	int i = 0;
+	for (; i + 2 <= n; i += 2)
+	{
+		__m128d v = _mm_loadu_pd(points + i);
+		__m128d dist = _mm_andnot_pd(sign, _mm_sub_pd(_mm_set1_pd(centroids[0]), v));
+		__m128d label = _mm_setzero_pd();
+		for (int j = 1; j < k; j++)
+		{
+			__m128d d = _mm_andnot_pd(sign, _mm_sub_pd(_mm_set1_pd(centroids[j]), v));
+			__m128d lt = _mm_cmplt_pd(d, dist);
+			dist = _mm_or_pd(_mm_and_pd(lt, d), _mm_andnot_pd(lt, dist));
+			label = _mm_or_pd(_mm_and_pd(lt, _mm_set1_pd((double)j)), _mm_andnot_pd(lt, label));
+		}
+		_mm_storel_epi64((__m128i*)(out + i), _mm_cvtpd_epi32(label));
+	}
+	nearest_scalar(points + i, n - i, centroids, k, out + i);
+}
+
+static double d2_round_f8_sse2(const double* points, int pc, double newest, double* mindist, double* cdf)
+{
+	const __m128d c = _mm_set1_pd(newest);
+	double total = 0.0;
+	int j = 0;
+	for (; j + 2 <= pc; j += 2)
+	{
+		__m128d d = _mm_sub_pd(_mm_loadu_pd(points + j), c);
+		d = _mm_mul_pd(d, d);
+		_mm_storeu_pd(mindist + j, _mm_min_pd(d, _mm_loadu_pd(mindist + j)));
+		total = cdf_run(mindist, cdf, j, j + 2, total);
+	}
+	for (; j < pc; j++)
+		total = d2_step(points[j], j, newest, mindist, cdf, total);
+	return total;
+}
+
+static double d2_round_f4_sse2(const float4* points, int pc, double newest, double* mindist, double* cdf)
+{
+	const __m128d c = _mm_set1_pd(newest);
+	double total = 0.0;
+	int j = 0;
+	for (; j + 2 <= pc; j += 2)
+	{
+		__m128d v = _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i*)(points + j))));
+		__m128d d = _mm_sub_pd(v, c);
+		d = _mm_mul_pd(d, d);
+		_mm_storeu_pd(mindist + j, _mm_min_pd(d, _mm_loadu_pd(mindist + j)));
+		total = cdf_run(mindist, cdf, j, j + 2, total);
+	}
+	for (; j < pc; j++)
+		total = d2_step((double)points[j], j, newest, mindist, cdf, total);
+	return total;
+}
+
+static int adjacency_count_sse2(const double* values, int n, double threshold)
+{
+	const __m128d sign = _mm_set1_pd(-0.0);
+	const __m128d zero = _mm_setzero_pd();
+	const __m128d limit = _mm_set1_pd(threshold);
+	int total = 0;
+	int a = 1;
+	for (; a + 2 <= n; a += 2)
+	{
+		__m128d l = _mm_loadu_pd(values + a);
+		__m128d r = _mm_loadu_pd(values + a - 1);
+		__m128d rd = _mm_div_pd(_mm_sub_pd(l, r), _mm_min_pd(l, r));
+		__m128d rzero = _mm_cmpeq_pd(r, zero);
+		rd = _mm_or_pd(_mm_and_pd(rzero, l), _mm_andnot_pd(rzero, rd));
+		__m128d lzero = _mm_cmpeq_pd(l, zero);
+		rd = _mm_or_pd(_mm_and_pd(lzero, r), _mm_andnot_pd(lzero, rd));
+		total += mask_bits((unsigned int)_mm_movemask_pd(_mm_cmpgt_pd(_mm_andnot_pd(sign, rd), limit)));
+	}
+	return total + adjacency_count_scalar(values + a - 1, n - a + 1, threshold);
+}
+
+/* AVX2 */
+
+KSIMD_TARGET("avx2")
+static void nearest_avx2(const double* points, int n, const double* centroids, int k, int32* out)
+{
+	const __m256d sign = _mm256_set1_pd(-0.0);
+	int i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		__m256d v = _mm256_loadu_pd(points + i);
+		__m256d dist = _mm256_andnot_pd(sign, _mm256_sub_pd(_mm256_set1_pd(centroids[0]), v));
+		__m256d label = _mm256_setzero_pd();
+		for (int j = 1; j < k; j++)
+		{
+			__m256d d = _mm256_andnot_pd(sign, _mm256_sub_pd(_mm256_set1_pd(centroids[j]), v));
+			__m256d lt = _mm256_cmp_pd(d, dist, _CMP_LT_OQ);
+			dist = _mm256_blendv_pd(dist, d, lt);
+			label = _mm256_blendv_pd(label, _mm256_set1_pd((double)j), lt);
+		}
+		_mm_storeu_si128((__m128i*)(out + i), _mm256_cvtpd_epi32(label));
+	}
+	nearest_scalar(points + i, n - i, centroids, k, out + i);
+}
+
+KSIMD_TARGET("avx2")
+static double d2_round_f8_avx2(const double* points, int pc, double newest, double* mindist, double* cdf)
+{
+	const __m256d c = _mm256_set1_pd(newest);
+	double total = 0.0;
+	int j = 0;
+	for (; j + 4 <= pc; j += 4)
+	{
+		__m256d d = _mm256_sub_pd(_mm256_loadu_pd(points + j), c);
+		d = _mm256_mul_pd(d, d);
+		_mm256_storeu_pd(mindist + j, _mm256_min_pd(d, _mm256_loadu_pd(mindist + j)));
+		total = cdf_run(mindist, cdf, j, j + 4, total);
+	}
+	for (; j < pc; j++)
+		total = d2_step(points[j], j, newest, mindist, cdf, total);
+	return total;
+}
+
+KSIMD_TARGET("avx2")
+static double d2_round_f4_avx2(const float4* points, int pc, double newest, double* mindist, double* cdf)
+{
+	const __m256d c = _mm256_set1_pd(newest);
+	double total = 0.0;
+	int j = 0;
+	for (; j + 4 <= pc; j += 4)
+	{
+		__m256d d = _mm256_sub_pd(_mm256_cvtps_pd(_mm_loadu_ps(points + j)), c);
+		d = _mm256_mul_pd(d, d);
+		_mm256_storeu_pd(mindist + j, _mm256_min_pd(d, _mm256_loadu_pd(mindist + j)));
+		total = cdf_run(mindist, cdf, j, j + 4, total);
+	}
+	for (; j < pc; j++)
+		total = d2_step((double)points[j], j, newest, mindist, cdf, total);
+	return total;
+}
+
+KSIMD_TARGET("avx2")
+static int adjacency_count_avx2(const double* values, int n, double threshold)
+{
+	const __m256d sign = _mm256_set1_pd(-0.0);
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d limit = _mm256_set1_pd(threshold);
+	int total = 0;
+	int a = 1;
+	for (; a + 4 <= n; a += 4)
+	{
+		__m256d l = _mm256_loadu_pd(values + a);
+		__m256d r = _mm256_loadu_pd(values + a - 1);
+		__m256d rd = _mm256_div_pd(_mm256_sub_pd(l, r), _mm256_min_pd(l, r));
+		rd = _mm256_blendv_pd(rd, l, _mm256_cmp_pd(r, zero, _CMP_EQ_OQ));
+		rd = _mm256_blendv_pd(rd, r, _mm256_cmp_pd(l, zero, _CMP_EQ_OQ));
+		total += mask_bits((unsigned int)_mm256_movemask_pd(_mm256_cmp_pd(_mm256_andnot_pd(sign, rd), limit, _CMP_GT_OQ)));
+	}
+	return total + adjacency_count_scalar(values + a - 1, n - a + 1, threshold);
+}
+
+/* AVX-512 (F) */
+
+KSIMD_TARGET("avx512f")
+static void nearest_avx512(const double* points, int n, const double* centroids, int k, int32* out)
+{
+	int i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		__m512d v = _mm512_loadu_pd(points + i);
+		__m512d dist = _mm512_abs_pd(_mm512_sub_pd(_mm512_set1_pd(centroids[0]), v));
+		__m512d label = _mm512_setzero_pd();
+		for (int j = 1; j < k; j++)
+		{
+			__m512d d = _mm512_abs_pd(_mm512_sub_pd(_mm512_set1_pd(centroids[j]), v));
+			__mmask8 lt = _mm512_cmp_pd_mask(d, dist, _CMP_LT_OQ);
+			dist = _mm512_mask_blend_pd(lt, dist, d);
+			label = _mm512_mask_blend_pd(lt, label, _mm512_set1_pd((double)j));
+		}
+		_mm256_storeu_si256((__m256i*)(out + i), _mm512_cvtpd_epi32(label));
+	}
+	nearest_scalar(points + i, n - i, centroids, k, out + i);
+}
+
+KSIMD_TARGET("avx512f")
+static double d2_round_f8_avx512(const double* points, int pc, double newest, double* mindist, double* cdf)
+{
+	const __m512d c = _mm512_set1_pd(newest);
+	double total = 0.0;
+	int j = 0;
+	for (; j + 8 <= pc; j += 8)
+	{
+		__m512d d = _mm512_sub_pd(_mm512_loadu_pd(points + j), c);
+		d = _mm512_mul_pd(d, d);
+		_mm512_storeu_pd(mindist + j, _mm512_min_pd(d, _mm512_loadu_pd(mindist + j)));
+		total = cdf_run(mindist, cdf, j, j + 8, total);
+	}
+	for (; j < pc; j++)
+		total = d2_step(points[j], j, newest, mindist, cdf, total);
+	return total;
+}
+
+KSIMD_TARGET("avx512f")
+static double d2_round_f4_avx512(const float4* points, int pc, double newest, double* mindist, double* cdf)
+{
+	const __m512d c = _mm512_set1_pd(newest);
+	double total = 0.0;
+	int j = 0;
+	for (; j + 8 <= pc; j += 8)
+	{
+		__m512d d = _mm512_sub_pd(_mm512_cvtps_pd(_mm256_loadu_ps(points + j)), c);
+		d = _mm512_mul_pd(d, d);
+		_mm512_storeu_pd(mindist + j, _mm512_min_pd(d, _mm512_loadu_pd(mindist + j)));
+		total = cdf_run(mindist, cdf, j, j + 8, total);
+	}
+	for (; j < pc; j++)
+		total = d2_step((double)points[j], j, newest, mindist, cdf, total);
+	return total;
+}
+
+KSIMD_TARGET("avx512f")
+static int adjacency_count_avx512(const double* values, int n, double threshold)
+{
+	const __m512d zero = _mm512_setzero_pd();
+	const __m512d limit = _mm512_set1_pd(threshold);
+	int total = 0;
+	int a = 1;
+	for (; a + 8 <= n; a += 8)
+	{
+		__m512d l = _mm512_loadu_pd(values + a);
+		__m512d r = _mm512_loadu_pd(values + a - 1);
+		__m512d rd = _mm512_div_pd(_mm512_sub_pd(l, r), _mm512_min_pd(l, r));
+		rd = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(r, zero, _CMP_EQ_OQ), rd, l);
+		rd = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(l, zero, _CMP_EQ_OQ), rd, r);
+		total += mask_bits((unsigned int)_mm512_cmp_pd_mask(_mm512_abs_pd(rd), limit, _CMP_GT_OQ));
+	}
+	return total + adjacency_count_scalar(values + a - 1, n - a + 1, threshold);
+}
+
+#endif
+
+#ifdef KSIMD_ARM64
+
+/* NEON, always present on ARM64 */
+
+static void nearest_neon(const double* points, int n, const double* centroids, int k, int32* out)
+{
+	int i = 0;
+	for (; i + 2 <= n; i += 2)
+	{
+		float64x2_t v = vld1q_f64(points + i);
+		float64x2_t dist = vabsq_f64(vsubq_f64(vdupq_n_f64(centroids[0]), v));
+		float64x2_t label = vdupq_n_f64(0.0);
+		for (int j = 1; j < k; j++)
+		{
+			float64x2_t d = vabsq_f64(vsubq_f64(vdupq_n_f64(centroids[j]), v));
+			uint64x2_t lt = vcltq_f64(d, dist);
+			dist = vbslq_f64(lt, d, dist);
+			label = vbslq_f64(lt, vdupq_n_f64((double)j), label);
+		}
+		vst1_s32(out + i, vmovn_s64(vcvtq_s64_f64(label)));
+	}
+	nearest_scalar(points + i, n - i, centroids, k, out + i);
+}
+
+// NEON fmin is not a < b ? a : b for NaNs, so the min is an explicit compare and select
+static double d2_round_f8_neon(const double* points, int pc, double newest, double* mindist, double* cdf)
+{
+	const float64x2_t c = vdupq_n_f64(newest);
+	double total = 0.0;
+	int j = 0;
+	for (; j + 2 <= pc; j += 2)
+	{
+		float64x2_t d = vsubq_f64(vld1q_f64(points + j), c);
+		d = vmulq_f64(d, d);
+		float64x2_t m = vld1q_f64(mindist + j);
+		vst1q_f64(mindist + j, vbslq_f64(vcltq_f64(d, m), d, m));
+		total = cdf_run(mindist, cdf, j, j + 2, total);
+	}
+	for (; j < pc; j++)
+		total = d2_step(points[j], j, newest, mindist, cdf, total);
+	return total;
+}
+
+static double d2_round_f4_neon(const float4* points, int pc, double newest, double* mindist, double* cdf)
+{
+	const float64x2_t c = vdupq_n_f64(newest);
+	double total = 0.0;
+	int j = 0;
+	for (; j + 2 <= pc; j += 2)
+	{
+		float64x2_t d = vsubq_f64(vcvt_f64_f32(vld1_f32(points + j)), c);
+		d = vmulq_f64(d, d);
+		float64x2_t m = vld1q_f64(mindist + j);
+		vst1q_f64(mindist + j, vbslq_f64(vcltq_f64(d, m), d, m));
+		total = cdf_run(mindist, cdf, j, j + 2, total);
+	}
+	for (; j < pc; j++)
+		total = d2_step((double)points[j], j, newest, mindist, cdf, total);
+	return total;
+}
+
+static int adjacency_count_neon(const double* values, int n, double threshold)
+{
+	const float64x2_t zero = vdupq_n_f64(0.0);
+	const float64x2_t limit = vdupq_n_f64(threshold);
+	int total = 0;
+	int a = 1;
+	for (; a + 2 <= n; a += 2)
+	{
+		float64x2_t l = vld1q_f64(values + a);
+		float64x2_t r = vld1q_f64(values + a - 1);
+		float64x2_t rd = vdivq_f64(vsubq_f64(l, r), vbslq_f64(vcltq_f64(l, r), l, r));
+		rd = vbslq_f64(vceqq_f64(r, zero), l, rd);
+		rd = vbslq_f64(vceqq_f64(l, zero), r, rd);
+		uint64x2_t gt = vcgtq_f64(vabsq_f64(rd), limit);
+		total += (int)(vgetq_lane_u64(gt, 0) & 1) + (int)(vgetq_lane_u64(gt, 1) & 1);
+	}
+	return total + adjacency_count_scalar(values + a - 1, n - a + 1, threshold);
+}
+
+#endif
+
+KSimdKernels ksimd = {
+	nearest_scalar, d2_round_f8_scalar, d2_round_f4_scalar, adjacency_count_scalar, KSIMD_SCALAR
+};
+
+/// <summary>
+/// Best instruction set this CPU and OS support
+/// </summary>
+KSimdLevel ksimd_detect(void)
+{
+#if defined(KSIMD_X86) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	int max_leaf = info[0];
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	if (max_leaf < 7 || !osxsave || !avx)
+		return KSIMD_SSE2;
+	unsigned __int64 xcr0 = _xgetbv(0);
+	__cpuidex(info, 7, 0);
+	// The OS must save the ymm (and for AVX-512 the opmask and zmm) registers
+	if ((xcr0 & 0xE6) == 0xE6 && (info[1] & (1 << 16)) != 0)
+		return KSIMD_AVX512;
+	if ((xcr0 & 0x6) == 0x6 && (info[1] & (1 << 5)) != 0)
+		return KSIMD_AVX2;
+	return KSIMD_SSE2;
+#elif defined(KSIMD_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return KSIMD_AVX512;
+	if (__builtin_cpu_supports("avx2"))
+		return KSIMD_AVX2;
+	return KSIMD_SSE2;
+#elif defined(KSIMD_ARM64)
+	return KSIMD_NEON;
+#else
+	return KSIMD_SCALAR;
+#endif
+}
+
+/// <summary>
+/// Use the kernels for level, or the best supported one below it. KSIMD_AUTO picks the best supported.
+/// </summary>
+void ksimd_select(int level)
+{
+	KSimdLevel best = ksimd_detect();
+	if (level == KSIMD_AUTO)
+		level = best;
+
+	ksimd.nearest = nearest_scalar;
+	ksimd.d2_round_f8 = d2_round_f8_scalar;
+	ksimd.d2_round_f4 = d2_round_f4_scalar;
+	ksimd.adjacency_count = adjacency_count_scalar;
+	ksimd.level = KSIMD_SCALAR;
+
+	if (level == KSIMD_SCALAR)
+		return;
+
+#ifdef KSIMD_X86
+	if (level > best)
+		level = best;
+	if (level == KSIMD_AVX512)
+	{
+		ksimd.nearest = nearest_avx512;
+		ksimd.d2_round_f8 = d2_round_f8_avx512;
+		ksimd.d2_round_f4 = d2_round_f4_avx512;
+		ksimd.adjacency_count = adjacency_count_avx512;
+		ksimd.level = KSIMD_AVX512;
+	}
+	else if (level == KSIMD_AVX2)
+	{
+		ksimd.nearest = nearest_avx2;
+		ksimd.d2_round_f8 = d2_round_f8_avx2;
+		ksimd.d2_round_f4 = d2_round_f4_avx2;
+		ksimd.adjacency_count = adjacency_count_avx2;
+		ksimd.level = KSIMD_AVX2;
+	}
+	else
+	{
+		ksimd.nearest = nearest_sse2;
+		ksimd.d2_round_f8 = d2_round_f8_sse2;
+		ksimd.d2_round_f4 = d2_round_f4_sse2;
+		ksimd.adjacency_count = adjacency_count_sse2;
+		ksimd.level = KSIMD_SSE2;
+	}
+#endif
+
+#ifdef KSIMD_ARM64
+	ksimd.nearest = nearest_neon;
+	ksimd.d2_round_f8 = d2_round_f8_neon;
+	ksimd.d2_round_f4 = d2_round_f4_neon;
+	ksimd.adjacency_count = adjacency_count_neon;
+	ksimd.level = KSIMD_NEON;
+#endif
+}
+
+const char* ksimd_level_name(KSimdLevel level)
+{
+	for (int i = 0; ksimd_options[i].name != NULL; i++)
+	{
+		if (ksimd_options[i].val == (int)level)
+			return ksimd_options[i].name;
+	}
+	return "unknown";
+}
+
+/// <summary>
+/// GUC assign hook for timecache.kplusplus_simd
+/// </summary>
+void ksimd_assign_hook(int newval, void* extra)
+{
+	ksimd_select(newval);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "timecache.h"
+
+/**
+* SIMD versions of the clustering kernels, chosen at runtime for the CPU
+*
+* x86-64 has SSE2, AVX2 and AVX-512 versions, ARM64 has NEON, anything else runs the scalar reference.
+* Every version does the same IEEE operations per point as the scalar reference, in the same order,
+* so labels, distances and totals are bit-identical whichever one runs. Totals that run along the points
+* (the D^2 cdf) stay a sequential scalar sum for that reason.
+*/
+
+// Instruction sets, timecache.kplusplus_simd
+typedef enum
+{
+	KSIMD_AUTO,
+	KSIMD_SCALAR,
+	KSIMD_SSE2,
+	KSIMD_AVX2,
+	KSIMD_AVX512,
+	KSIMD_NEON
+} KSimdLevel;
+
+// Points per call to the nearest kernel, callers keep a label buffer this long on the stack
+#define KSIMD_BLOCK 256
+
+typedef struct
+{
+	// out[i] = index of the centroid nearest to points[i], ties to the lowest index
+	void (*nearest)(const double* points, int n, const double* centroids, int k, int32* out);
+	// kvalues_d2_round() for float8 and float4 points
+	double (*d2_round_f8)(const double* points, int pc, double newest, double* mindist, double* cdf);
+	double (*d2_round_f4)(const float4* points, int pc, double newest, double* mindist, double* cdf);
+	// Number of i in [1, n) with |relative_diff_min(values[i], values[i - 1])| > threshold
+	int (*adjacency_count)(const double* values, int n, double threshold);
+	KSimdLevel level;
+} KSimdKernels;
+
+// The kernels in use, set by ksimd_select()
+extern KSimdKernels ksimd;
+extern int kplusplus_simd;
+extern const struct config_enum_entry ksimd_options[];
+
+KSimdLevel ksimd_detect(void);
+void ksimd_select(int level);
+const char* ksimd_level_name(KSimdLevel level);
+void ksimd_assign_hook(int newval, void* extra);
+
+// Scalar references
+void nearest_scalar(const double* points, int n, const double* centroids, int k, int32* out);
+int adjacency_count_scalar(const double* values, int n, double threshold);
+
+// ktests.c
+double relative_diff_min(double l, double r);
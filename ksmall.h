@@ -0,0 +1,96 @@
+/**
+* kplusplus restarts for one fixed k on small arrays, see kplusplus_small()
+*
+* No include guard: kplusplus.c includes this once per k, with KSMALL_K defined as k
+* and KSFN(name) naming that copy. With k a constant every loop over the clusters unrolls.
+*/
+
+/// <summary>
+/// accumulate_clusters() for KSMALL_K contiguous ranges of sorted points: cluster j is [starts[j], starts[j + 1]).
+/// The ranges are walked side by side so the divides of different clusters overlap.
+/// Each cluster still sees its own points in order, so the totals are identical.
+/// </summary>
+void KSFN(accumulate_ranges)(KValues arr, int* starts, ClusterAccum* accum)
+{
+	int common = INT_MAX;
+	for (int j = 0; j < KSMALL_K; j++)
+	{
+		accum_reset(&accum[j]);
+		if (starts[j + 1] - starts[j] < common)
+			common = starts[j + 1] - starts[j];
+	}
+
+	for (int i = 0; i < common; i++)
+	{
+		for (int j = 0; j < KSMALL_K; j++)
+			accum_add(&accum[j], kvalue(arr, starts[j] + i));
+	}
+	for (int j = 0; j < KSMALL_K; j++)
+	{
+		for (int i = starts[j] + common; i < starts[j + 1]; i++)
+			accum_add(&accum[j], kvalue(arr, i));
+	}
+}
+
+/// <summary>
+/// Best of seeds restarts of the bounded iteration on sorted points, the same pick internal_kplusplus() makes.
+/// Restarts often end on the same clusters, and the same clusters always give the same totals,
+/// so only clusters not seen before in this call are accumulated.
+/// mindist and cdf are pc long scratch buffers.
+/// </summary>
+/// <returns>false if seeding failed, otherwise the clusters of the best restart in best_starts</returns>
+bool KSFN(kpp_small)(KValues sorted, int pc, int seeds, int updates, uint64 seed, SortedPrefix* prefix,
+	double* mindist, double* cdf, int* best_starts, KInstrumentation* instr)
+{
+	KSmallSeen seen[KSMALL_SEEN];
+	int seen_count = 0;
+	double best_score = 0.0;
+
+	int indices[KSMALL_K];
+	double centroids[KSMALL_K];
+	double bounds[KSMALL_K];
+	int starts[KSMALL_K + 1];
+	ClusterAccum accum[KSMALL_K];
+
+	for (int r = 0; r < seeds; r++)
+	{
+		KRandom rng;
+		krandom_seed(&rng, seed, (uint64)r);
+		if (!kplus_choose(sorted, pc, indices, KSMALL_K, centroids, mindist, cdf, &rng, NULL))
+			return false;
+		sort_centroids(centroids, KSMALL_K);
+		instr->restarts++;
+
+		kpp_bounded_ranges(sorted, pc, centroids, bounds, starts, KSMALL_K, updates, prefix, false, instr);
+
+		bool found = false;
+		double score = 0.0;
+		for (int s = 0; s < seen_count && !found; s++)
+		{
+			found = true;
+			for (int j = 1; j < KSMALL_K; j++)
+				found = found && seen[s].starts[j] == starts[j];
+			if (found)
+				score = seen[s].score;
+		}
+		if (!found)
+		{
+			KSFN(accumulate_ranges)(sorted, starts, accum);
+			score = score_accum(accum, KSMALL_K);
+			if (seen_count < KSMALL_SEEN)
+			{
+				memcpy(seen[seen_count].starts, starts, sizeof(int) * (KSMALL_K + 1));
+				seen[seen_count].score = score;
+				seen_count++;
+			}
+		}
+
+		// Ties keep the earlier restart
+		if (r == 0 || score < best_score)
+		{
+			best_score = score;
+			memcpy(best_starts, starts, sizeof(int) * (KSMALL_K + 1));
+		}
+	}
+	return true;
+}
@@ -1,4 +1,6 @@
 #include "timecache.h"
+#include "arrayinput.h"
+#include "ksimd.h"
 
 
 /***
@@ -93,83 +95,16 @@ Datum ktest_adjacency_rd(PG_FUNCTION_ARGS)
 		PG_RETURN_INT32(0);
 	}
 
-	bool* nullFlags;
-	int16 valueTypeWidth;
-	bool valueTypeByValue;
-	char valueTypeAlignCode;
-	Datum* valueContent;
+	float8* convertedArray = get_converted_array(arr, valueType, arrayLength);
 
-	get_typlenbyvalalign(valueType, &valueTypeWidth, &valueTypeByValue, &valueTypeAlignCode);
-	deconstruct_array(arr, valueType, valueTypeWidth, valueTypeByValue, valueTypeAlignCode, &valueContent, &nullFlags, &arrayLength);
+	int total = ksimd.adjacency_count(convertedArray, arrayLength, rdThreshold);
 
-	float8* convertedArray = palloc0(sizeof(float8) * arrayLength);
-	
-
-	switch (valueType)
-	{
-	case FLOAT8OID:
-		for (int i = 0; i < arrayLength; i++)
-		{
-			if (nullFlags[i])
-			{
-				//TODO: Allow nulls and treat as zero?
-				ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Null value in array at index %d", i));
-			}
-			convertedArray[i] = DatumGetFloat8(valueContent[i]);
-		}
-		break;
-	case FLOAT4OID:
-		for (int i = 0; i < arrayLength; i++)
-		{
-			if (nullFlags[i])
-			{
-				//TODO: Allow nulls and treat as zero?
-				ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Null value in array at index %d", i));
-			}
-			convertedArray[i] = (float8)DatumGetFloat4(valueContent[i]);
-		}
-		break;
-	case INT8OID:
-		for (int i = 0; i < arrayLength; i++)
-		{
-			if (nullFlags[i])
-			{
-				//TODO: Allow nulls and treat as zero?
-				ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Null value in array at index %d", i));
-			}
-			convertedArray[i] = (float8)DatumGetInt64(valueContent[i]);
-		}
-		break;
-	case INT4OID:
-		for (int i = 0; i < arrayLength; i++)
-		{
-			if (nullFlags[i])
-			{
-				//TODO: Allow nulls and treat as zero?
-				ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Null value in array at index %d", i));
-			}
-			convertedArray[i] = (float8)DatumGetInt32(valueContent[i]);
-		}
-		break;
-	default:
-		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Unsupported OID type, only FLOAT8/FLOAT4/INT8/INT4 allowed"));
-		break;
-	}
-
-	int total = 0;
-
-	for (int a = 1; a < arrayLength; a++)
-	{
-		float8 rd = fabs(relative_diff_min(convertedArray[a], convertedArray[a - 1]));
-		if (rd > rdThreshold)
-			total++;
-	}
 	// wraparound case
 	float8 rd = fabs(relative_diff_min(convertedArray[arrayLength - 1], convertedArray[0]));
 	if (rd > rdThreshold)
 		total++;
 
-	pfree(convertedArray);
+	free_converted_array(arr, convertedArray);
 
 	PG_RETURN_INT32(total);
 }
@@ -206,68 +141,7 @@ Datum ktest_adjacency_arr(PG_FUNCTION_ARGS)
 		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Array only contains a single value. At least 2 points are required to compute difference"));
 	}
 
-	bool* nullFlags;
-	int16 valueTypeWidth;
-	bool valueTypeByValue;
-	char valueTypeAlignCode;
-	Datum* valueContent;
-
-	get_typlenbyvalalign(valueType, &valueTypeWidth, &valueTypeByValue, &valueTypeAlignCode);
-	deconstruct_array(arr, valueType, valueTypeWidth, valueTypeByValue, valueTypeAlignCode, &valueContent, &nullFlags, &arrayLength);
-
-	float8* convertedArray = palloc0(sizeof(float8) * arrayLength);
-
-
-	switch (valueType)
-	{
-	case FLOAT8OID:
-		for (int i = 0; i < arrayLength; i++)
-		{
-			if (nullFlags[i])
-			{
-				//TODO: Allow nulls and treat as zero?
-				ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Null value in array at index %d", i));
-			}
-			convertedArray[i] = DatumGetFloat8(valueContent[i]);
-		}
-		break;
-	case FLOAT4OID:
-		for (int i = 0; i < arrayLength; i++)
-		{
-			if (nullFlags[i])
-			{
-				//TODO: Allow nulls and treat as zero?
-				ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Null value in array at index %d", i));
-			}
-			convertedArray[i] = (float8)DatumGetFloat4(valueContent[i]);
-		}
-		break;
-	case INT8OID:
-		for (int i = 0; i < arrayLength; i++)
-		{
-			if (nullFlags[i])
-			{
-				//TODO: Allow nulls and treat as zero?
-				ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Null value in array at index %d", i));
-			}
-			convertedArray[i] = (float8)DatumGetInt64(valueContent[i]);
-		}
-		break;
-	case INT4OID:
-		for (int i = 0; i < arrayLength; i++)
-		{
-			if (nullFlags[i])
-			{
-				//TODO: Allow nulls and treat as zero?
-				ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Null value in array at index %d", i));
-			}
-			convertedArray[i] = (float8)DatumGetInt32(valueContent[i]);
-		}
-		break;
-	default:
-		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Unsupported OID type, only FLOAT8/FLOAT4/INT8/INT4 allowed"));
-		break;
-	}
+	float8* convertedArray = get_converted_array(arr, valueType, arrayLength);
 
 
 	float8* ret = palloc0(sizeof(float8) * arrayLength);
@@ -279,7 +153,7 @@ Datum ktest_adjacency_arr(PG_FUNCTION_ARGS)
 	// wraparound case
 	ret[0] = relative_diff_min(convertedArray[arrayLength - 1], convertedArray[0]);
 
-	pfree(convertedArray);
+	free_converted_array(arr, convertedArray);
 
 
 	Datum* datum = palloc0(sizeof(Datum) * arrayLength);
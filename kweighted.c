@@ -0,0 +1,547 @@
+#include "kplusplus.h"
+#include "ksimd.h"
+
+/***
+* Clustering weighted points: values with counts, e.g. the (value, count) buckets of a rollup histogram
+*
+* A point of weight w stands for w observations of its value. Each point is kept as the ClusterAccum of those
+* observations (count w, mean the value, m2 0), the same form as kplusplus_agg's summaries, so the kernels work
+* per point while treating weights natively: seeding draws in proportion to weight, centroids are weighted means,
+* and cluster stats are the exact stats of the observations, built by merging the points' totals (merge_accum()).
+* A 5k-bucket histogram costs 5k points whatever the number of observations behind it.
+*
+* kplusplus_weighted(values, weights, k, seeds, updates [, cluster, seed]) - as kplusplus
+* kplusplus_weighted_all(values, weights, k, seeds, updates [, seed]) - as kplusplus_all
+* ksimple_weighted(values, weights, k) - as ksimple
+* kexact_weighted(values, weights, k) - as kexact
+* knear_weighted(values, weights, k, seeds, updates, target_value, min_cluster_count [, seed]) - as knear
+*
+* numcount is a cluster's total weight. Weights must be whole numbers >= 0, points with weight 0 are left out.
+*/
+PGDLLEXPORT Datum kplusplus_weighted(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum kplusplus_weighted_all(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum ksimple_weighted(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum kexact_weighted(PG_FUNCTION_ARGS);
+PGDLLEXPORT Datum knear_weighted(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(kplusplus_weighted);
+PG_FUNCTION_INFO_V1(kplusplus_weighted_all);
+PG_FUNCTION_INFO_V1(ksimple_weighted);
+PG_FUNCTION_INFO_V1(kexact_weighted);
+PG_FUNCTION_INFO_V1(knear_weighted);
+
+int compare_weighted_points(const void* a, const void* b)
+{
+	const ClusterAccum* pa = (const ClusterAccum*)a;
+	const ClusterAccum* pb = (const ClusterAccum*)b;
+	if (pa->mean != pb->mean)
+		return pa->mean < pb->mean ? -1 : 1;
+	if (pa->min != pb->min)
+		return pa->min < pb->min ? -1 : 1;
+	if (pa->max != pb->max)
+		return pa->max < pb->max ? -1 : 1;
+	return 0;
+}
+
+/// <summary>
+/// Merge runs of points with equal values, in points sorted by value
+/// </summary>
+/// <returns>the number of points left</returns>
+int merge_equal_points(ClusterAccum* points, int count)
+{
+	int distinct = 0;
+	for (int i = 0; i < count; i++)
+	{
+		if (distinct > 0 && points[distinct - 1].mean == points[i].mean)
+			merge_accum(&points[distinct - 1], &points[i]);
+		else
+			points[distinct++] = points[i];
+	}
+	return distinct;
+}
+
+/// <summary>
+/// Sort points by value and merge points with equal values, as kplusplus and kexact need them
+/// </summary>
+/// <returns>the number of points left</returns>
+int collapse_weighted_points(ClusterAccum* points, int count)
+{
+	qsort(points, count, sizeof(ClusterAccum), compare_weighted_points);
+	return merge_equal_points(points, count);
+}
+
+/// <summary>
+/// Points from a values array and a weights array of the same length, in array order, without the zero weights
+/// </summary>
+/// <param name="name">function name for error messages</param>
+/// <param name="count">set to the number of points</param>
+ClusterAccum* get_weighted_points(ArrayType* values, ArrayType* weights, const char* name, int* count)
+{
+	if (ARR_NDIM(values) != 1 || ARR_NDIM(weights) != 1)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("%s only supports 1-dimensional arrays.", name));
+	Oid valueType = ARR_ELEMTYPE(values);
+	Oid weightType = ARR_ELEMTYPE(weights);
+	if ((valueType != FLOAT4OID && valueType != FLOAT8OID && valueType != INT8OID && valueType != INT4OID)
+		|| (weightType != FLOAT4OID && weightType != FLOAT8OID && weightType != INT8OID && weightType != INT4OID))
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("%s supports only integer/float 4/8 types.", name));
+
+	int array_length = (ARR_DIMS(values))[0];
+	if (array_length < 1)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("%s empty array.", name));
+	if ((ARR_DIMS(weights))[0] != array_length)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("%s values and weights lengths differ: %d, %d", name, array_length, (ARR_DIMS(weights))[0]));
+
+	double* convValues = get_converted_array(values, valueType, array_length);
+	double* convWeights = get_converted_array(weights, weightType, array_length);
+
+	ClusterAccum* points = palloc(sizeof(ClusterAccum) * array_length);
+	int pc = 0;
+	double total = 0.0;
+	for (int i = 0; i < array_length; i++)
+	{
+		double w = convWeights[i];
+		if (!(w >= 0.0) || w != floor(w))
+			ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("%s weights must be whole numbers >= 0, given: %g at index %d", name, w, i));
+		if (isnan(convValues[i]) || isinf(convValues[i]))
+			ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("%s does not support NaN or infinite values, given at index %d", name, i));
+		if (w == 0.0)
+			continue;
+
+		// Cluster counts are int
+		total += w;
+		if (total > INT_MAX)
+			ereport(ERROR, errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED), errmsg("%s total weight must be <= %d", name, INT_MAX));
+
+		ClusterAccum* p = &points[pc++];
+		p->count = (int)w;
+		p->mean = convValues[i];
+		p->m2 = 0.0;
+		p->min = convValues[i];
+		p->max = convValues[i];
+	}
+
+	free_converted_array(weights, convWeights);
+	free_converted_array(values, convValues);
+
+	if (pc == 0)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("%s every weight is 0.", name));
+	*count = pc;
+	return points;
+}
+
+/// <summary>
+/// kplus_choose() for weighted points: the first centroid is drawn in proportion to weight,
+/// each following one in proportion to weight * D^2
+/// </summary>
+/// <returns>false if no point was left for a centroid</returns>
+bool kweighted_choose(double* means, double* weights, int pc, int* indices, int k, double* centroids, double* mindist, double* cdf, KRandom* rng)
+{
+	double total = 0.0;
+	for (int i = 0; i < pc; i++)
+	{
+		total += weights[i];
+		cdf[i] = total;
+		mindist[i] = DBL_MAX;
+	}
+	indices[0] = choose_weighted_index(cdf, pc, krandom_unit(rng) * total);
+	centroids[0] = means[indices[0]];
+
+	for (int c = 1; c < k; c++)
+	{
+		double newest = centroids[c - 1];
+		total = 0.0;
+		for (int i = 0; i < pc; i++)
+		{
+			double d = means[i] - newest;
+			if (d * d < mindist[i])
+				mindist[i] = d * d;
+			total += weights[i] * mindist[i];
+			cdf[i] = total;
+		}
+
+		int ind;
+		if (total > 0.0)
+			ind = choose_weighted_index(cdf, pc, krandom_unit(rng) * total);
+		else
+			ind = choose_unused_index(pc, indices, c, rng);
+
+		if (ind < 0)
+			return false;
+		indices[c] = ind;
+		centroids[c] = means[ind];
+	}
+	return true;
+}
+
+/// <summary>
+/// One restart of Lloyd's iteration over points sorted by value. Each cluster is a run of points,
+/// so assignment is one sweep against the midpoints. accum gets the totals of the final clusters.
+/// </summary>
+void kweighted_lloyd(ClusterAccum* points, int pc, double* centroids, double* bounds, int k, int updates, ClusterAccum* accum)
+{
+	for (int u = 0; u < updates; u++)
+	{
+		kinstrumentation.iterations++;
+		kinstrumentation.points_evaluated += pc;
+		compute_boundaries(centroids, k, bounds);
+
+		for (int j = 0; j < k; j++)
+			accum_reset(&accum[j]);
+		int j = 0;
+		for (int i = 0; i < pc; i++)
+		{
+			while (j < k - 1 && points[i].mean > bounds[j])
+				j++;
+			merge_accum(&accum[j], &points[i]);
+		}
+
+		bool moved = false;
+		for (int c = 0; c < k; c++)
+		{
+			double mean = accum[c].count > 0 ? accum[c].mean : 0.0;
+			if (centroids[c] != mean)
+			{
+				centroids[c] = mean;
+				moved = true;
+			}
+		}
+		if (!moved)
+			break;
+		// Empty clusters fall back to 0, keep the centroids ordered for the sweep
+		sort_centroids(centroids, k);
+	}
+}
+
+/// <summary>
+/// Best of seeds weighted k-means++ restarts, see internal_kplusplus(). Ties keep the earlier restart.
+/// points must be sorted by value with equal values merged (collapse_weighted_points()), and at least k of them.
+/// </summary>
+/// <returns>k totals in value order</returns>
+ClusterAccum* internal_kplusplus_weighted(ClusterAccum* points, int pc, int k, int seeds, int updates, uint64 seed)
+{
+	kinstrumentation.calls++;
+	return kplusplus_weighted_restarts(points, pc, k, seeds, updates, seed);
+}
+
+/// <summary>
+/// internal_kplusplus_weighted() without counting a call, for callers that already have
+/// </summary>
+ClusterAccum* kplusplus_weighted_restarts(ClusterAccum* points, int pc, int k, int seeds, int updates, uint64 seed)
+{
+	ClusterAccum* best = palloc(sizeof(ClusterAccum) * k);
+
+	KCall call;
+	kcall_begin(&call);
+
+	double* means = palloc(sizeof(double) * pc);
+	double* weights = palloc(sizeof(double) * pc);
+	for (int i = 0; i < pc; i++)
+	{
+		means[i] = points[i].mean;
+		weights[i] = points[i].count;
+	}
+	double* mindist = palloc(sizeof(double) * pc);
+	double* cdf = palloc(sizeof(double) * pc);
+	int* indices = palloc(sizeof(int) * k);
+	double* centroids = palloc(sizeof(double) * k);
+	double* bounds = palloc(sizeof(double) * k);
+	ClusterAccum* accum = palloc(sizeof(ClusterAccum) * k);
+
+	if (seeds < 1)
+		seeds = 1;
+	bool failed = false;
+	double best_score = 0.0;
+	for (int r = 0; r < seeds; r++)
+	{
+		KRandom rng;
+		krandom_seed(&rng, seed, (uint64)r);
+		if (!kweighted_choose(means, weights, pc, indices, k, centroids, mindist, cdf, &rng))
+		{
+			failed = true;
+			break;
+		}
+		sort_centroids(centroids, k);
+		kinstrumentation.restarts++;
+
+		kweighted_lloyd(points, pc, centroids, bounds, k, updates, accum);
+
+		double score = score_accum(accum, k);
+		if (r == 0 || score < best_score)
+		{
+			best_score = score;
+			memcpy(best, accum, sizeof(ClusterAccum) * k);
+		}
+	}
+
+	kcall_end(&call);
+
+	if (failed)
+		ereport(ERROR, errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION), errmsg("kplusplus - failure - no unused point for a centroid."));
+	return best;
+}
+
+/// <summary>
+/// internal_ksimple() for weighted points in array order: centroids at the biggest breaks between neighbouring
+/// values (weights don't move a break), each point to its nearest centroid
+/// </summary>
+/// <returns>k totals</returns>
+ClusterAccum* internal_ksimple_weighted(ClusterAccum* points, int pc, int k)
+{
+	ClusterAccum* accum = palloc(sizeof(ClusterAccum) * k);
+	for (int j = 0; j < k; j++)
+		accum_reset(&accum[j]);
+
+	KCall call;
+	kcall_begin(&call);
+
+	double* values = palloc(sizeof(double) * pc);
+	for (int i = 0; i < pc; i++)
+		values[i] = points[i].mean;
+
+	if (pc > 1)
+	{
+		int* indices = palloc(sizeof(int) * k);
+		double* centroids = palloc(sizeof(double) * k);
+		kplus_choose_simple(values, pc, indices, k, centroids);
+
+		int32 nearest[KSIMD_BLOCK];
+		for (int b = 0; b < pc; b += KSIMD_BLOCK)
+		{
+			int n = pc - b < KSIMD_BLOCK ? pc - b : KSIMD_BLOCK;
+			ksimd.nearest(values + b, n, centroids, k, nearest);
+			for (int i = 0; i < n; i++)
+				merge_accum(&accum[nearest[i]], &points[b + i]);
+		}
+	}
+	else
+		merge_accum(&accum[0], &points[0]);
+
+	kcall_end(&call);
+
+	return accum;
+}
+
+/// <summary>
+/// The cluster kplusplus's cluster argument picks: c = k - 1 (the default) is the largest by count, 0 the smallest.
+/// Equal counts go to the lower index.
+/// </summary>
+int weighted_cluster_by_size(ClusterAccum* accum, int k, int c)
+{
+	int* order = palloc(sizeof(int) * k);
+	for (int i = 0; i < k; i++)
+	{
+		int j = i - 1;
+		while (j >= 0 && accum[order[j]].count < accum[i].count)
+		{
+			order[j + 1] = order[j];
+			j--;
+		}
+		order[j + 1] = i;
+	}
+	int index = order[k - 1 - c];
+	pfree(order);
+	return index;
+}
+
+/// <summary>
+/// The (average, minimum, maximum, standarddev, numcount) record of one cluster
+/// </summary>
+Datum weighted_stats_datum(TupleDesc tupDesc, ClusterAccum* accum)
+{
+	ClusterStats stats;
+	fill_cluster_stats(accum, &stats);
+
+	bool isnull[5];
+	for (int i = 0; i < 5; i++)
+		isnull[i] = false;
+	Datum retDat[5];
+	retDat[0] = Float8GetDatum(stats.average);
+	retDat[1] = Float8GetDatum(stats.min);
+	retDat[2] = Float8GetDatum(stats.max);
+	retDat[3] = Float8GetDatum(stats.stddev);
+	retDat[4] = Int32GetDatum(stats.count);
+
+	BlessTupleDesc(tupDesc);
+	HeapTuple hd = heap_form_tuple(tupDesc, retDat, isnull);
+	return HeapTupleGetDatum(hd);
+}
+
+/// <summary>
+/// Points from the values and weights arguments, sorted with equal values merged unless keep_order.
+/// Checks k against the number of points.
+/// </summary>
+ClusterAccum* get_weighted_args(FunctionCallInfo fcinfo, const char* name, int k, bool keep_order, int* count)
+{
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("%s called with NULL array.", name));
+	if (k < 1)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("%s k must be >= 1, given: %d", name, k));
+
+	ClusterAccum* points = get_weighted_points(PG_GETARG_ARRAYTYPE_P(0), PG_GETARG_ARRAYTYPE_P(1), name, count);
+	if (!keep_order)
+		*count = collapse_weighted_points(points, *count);
+
+	if (k > *count)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("%s %d distinct weighted values less than k: %d", name, *count, k));
+	return points;
+}
+
+Datum kplusplus_weighted(PG_FUNCTION_ARGS)
+{
+	TupleDesc tupDesc;
+
+	if (get_call_result_type(fcinfo, NULL, &tupDesc) != TYPEFUNC_COMPOSITE)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Function call not composite."));
+	if (fcinfo->nargs < 5)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kplusplus_weighted requires five arguments: values,weights,k,seeds,updates. Optionally a cluster index and a seed."));
+
+	int k = PG_GETARG_INT32(2);
+	int seeds = PG_GETARG_INT32(3);
+	int updates = PG_GETARG_INT32(4);
+	if (updates < 1)
+		updates = 1;
+	int c = fcinfo->nargs > 5 && !PG_ARGISNULL(5) ? PG_GETARG_INT32(5) : k - 1;
+	if (c >= k || c < 0)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kplusplus_weighted invalid cluster index given: %d", c));
+
+	int pc;
+	ClusterAccum* points = get_weighted_args(fcinfo, "kplusplus_weighted", k, false, &pc);
+	ClusterAccum* accum = internal_kplusplus_weighted(points, pc, k, seeds, updates, krandom_seed_arg(fcinfo, 6));
+
+	Datum d = weighted_stats_datum(tupDesc, &accum[weighted_cluster_by_size(accum, k, c)]);
+
+	pfree(accum);
+	pfree(points);
+
+	PG_RETURN_DATUM(d);
+}
+
+/**
+ * kplusplus_weighted, but returns all clusters
+ * implemented as a materialize mode srf, cluster_number ordered by value
+ */
+Datum kplusplus_weighted_all(PG_FUNCTION_ARGS)
+{
+	if (fcinfo->nargs < 5)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kplusplus_weighted_all requires five arguments: values,weights,k,seeds,updates. Optionally a seed."));
+
+	int k = PG_GETARG_INT32(2);
+	int seeds = PG_GETARG_INT32(3);
+	int updates = PG_GETARG_INT32(4);
+	if (updates < 1)
+		updates = 1;
+
+	int pc;
+	ClusterAccum* points = get_weighted_args(fcinfo, "kplusplus_weighted_all", k, false, &pc);
+
+	TupleDesc tupDesc;
+	Tuplestorestate* tupstore = kmaterialize_begin(fcinfo, &tupDesc);
+
+	ClusterAccum* accum = internal_kplusplus_weighted(points, pc, k, seeds, updates, krandom_seed_arg(fcinfo, 5));
+	pfree(points);
+
+	ClusterStats* stats = palloc(sizeof(ClusterStats) * k);
+	for (int i = 0; i < k; i++)
+		fill_cluster_stats(&accum[i], &stats[i]);
+	pfree(accum);
+
+	kmaterialize_clusters(tupstore, tupDesc, stats, k);
+	pfree(stats);
+
+	return (Datum)0;
+}
+
+Datum ksimple_weighted(PG_FUNCTION_ARGS)
+{
+	TupleDesc tupDesc;
+
+	if (get_call_result_type(fcinfo, NULL, &tupDesc) != TYPEFUNC_COMPOSITE)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Function call not composite."));
+	if (fcinfo->nargs < 3)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("ksimple_weighted requires three arguments: values,weights,k."));
+
+	int k = PG_GETARG_INT32(2);
+
+	// Breaks are between neighbours in array order, as in ksimple
+	int pc;
+	ClusterAccum* points = get_weighted_args(fcinfo, "ksimple_weighted", k, true, &pc);
+	ClusterAccum* accum = internal_ksimple_weighted(points, pc, k);
+
+	Datum d = weighted_stats_datum(tupDesc, &accum[weighted_cluster_by_size(accum, k, k - 1)]);
+
+	pfree(accum);
+	pfree(points);
+
+	PG_RETURN_DATUM(d);
+}
+
+Datum kexact_weighted(PG_FUNCTION_ARGS)
+{
+	TupleDesc tupDesc;
+
+	if (get_call_result_type(fcinfo, NULL, &tupDesc) != TYPEFUNC_COMPOSITE)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Function call not composite."));
+	if (fcinfo->nargs < 3)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("kexact_weighted requires three arguments: values,weights,k."));
+
+	int k = PG_GETARG_INT32(2);
+
+	int pc;
+	ClusterAccum* points = get_weighted_args(fcinfo, "kexact_weighted", k, false, &pc);
+	ClusterAccum* accum = internal_kexact_weighted(points, pc, k);
+
+	Datum d = weighted_stats_datum(tupDesc, &accum[weighted_cluster_by_size(accum, k, k - 1)]);
+
+	pfree(accum);
+	pfree(points);
+
+	PG_RETURN_DATUM(d);
+}
+
+Datum knear_weighted(PG_FUNCTION_ARGS)
+{
+	TupleDesc tupDesc;
+
+	if (get_call_result_type(fcinfo, NULL, &tupDesc) != TYPEFUNC_COMPOSITE)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("Function call not composite."));
+	if (fcinfo->nargs < 7)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("knear_weighted requires seven arguments: values,weights,k,seeds,updates,target_value,min_cluster_count. Optionally a seed."));
+
+	int k = PG_GETARG_INT32(2);
+	int seeds = PG_GETARG_INT32(3);
+	int updates = PG_GETARG_INT32(4);
+	if (updates < 1)
+		updates = 1;
+	double target_value = PG_GETARG_FLOAT8(5);
+	int min_cluster_count = PG_GETARG_INT32(6);
+	if (min_cluster_count < 1)
+		min_cluster_count = 1;
+
+	int pc;
+	ClusterAccum* points = get_weighted_args(fcinfo, "knear_weighted", k, false, &pc);
+	ClusterAccum* accum = internal_kplusplus_weighted(points, pc, k, seeds, updates, krandom_seed_arg(fcinfo, 7));
+
+	// min_cluster_count is against the total weight
+	double closestDist = DBL_MAX;
+	int index = -1;
+	for (int i = 0; i < k; i++)
+	{
+		if (accum[i].count >= min_cluster_count)
+		{
+			double dist = fabs(accum[i].mean - target_value);
+			if (dist < closestDist)
+			{
+				closestDist = dist;
+				index = i;
+			}
+		}
+	}
+	if (index < 0)
+		ereport(ERROR, errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("knear_weighted failed to locate valid cluster index."));
+
+	Datum d = weighted_stats_datum(tupDesc, &accum[index]);
+
+	pfree(accum);
+	pfree(points);
+
+	PG_RETURN_DATUM(d);
+}
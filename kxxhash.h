@@ -0,0 +1,113 @@
+#pragma once
+
+#include "timecache.h"
+
+/**
+* XXH64, a fast non-cryptographic 64 bit hash, for keying cached results by the bytes of an array
+*
+* Reads its input 8 bytes at a time as little-endian words, so hashes are the reference values
+* on little-endian machines. They are only ever compared within one server, never stored.
+*
+* https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+*/
+
+#define KXXH_PRIME1 UINT64CONST(0x9E3779B185EBCA87)
+#define KXXH_PRIME2 UINT64CONST(0xC2B2AE3D27D4EB4F)
+#define KXXH_PRIME3 UINT64CONST(0x165667B19E3779F9)
+#define KXXH_PRIME4 UINT64CONST(0x85EBCA77C2B2AE63)
+#define KXXH_PRIME5 UINT64CONST(0x27D4EB2F165667C5)
+
+static inline uint64 kxxh_rotl(uint64 x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64 kxxh_read64(const char* p)
+{
+	uint64 v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32 kxxh_read32(const char* p)
+{
+	uint32 v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64 kxxh_round(uint64 acc, uint64 input)
+{
+	acc += input * KXXH_PRIME2;
+	acc = kxxh_rotl(acc, 31);
+	return acc * KXXH_PRIME1;
+}
+
+static inline uint64 kxxh_merge(uint64 acc, uint64 val)
+{
+	acc ^= kxxh_round(0, val);
+	return acc * KXXH_PRIME1 + KXXH_PRIME4;
+}
+
+/// <summary>
+/// XXH64 of len bytes at data
+/// </summary>
+static inline uint64 kxxhash64(const void* data, Size len, uint64 seed)
+{
+	const char* p = (const char*)data;
+	const char* end = p + len;
+	uint64 h;
+
+	if (len >= 32)
+	{
+		uint64 v1 = seed + KXXH_PRIME1 + KXXH_PRIME2;
+		uint64 v2 = seed + KXXH_PRIME2;
+		uint64 v3 = seed;
+		uint64 v4 = seed - KXXH_PRIME1;
+		const char* limit = end - 32;
+		do
+		{
+			v1 = kxxh_round(v1, kxxh_read64(p));
+			v2 = kxxh_round(v2, kxxh_read64(p + 8));
+			v3 = kxxh_round(v3, kxxh_read64(p + 16));
+			v4 = kxxh_round(v4, kxxh_read64(p + 24));
+			p += 32;
+		} while (p <= limit);
+
+		h = kxxh_rotl(v1, 1) + kxxh_rotl(v2, 7) + kxxh_rotl(v3, 12) + kxxh_rotl(v4, 18);
+		h = kxxh_merge(h, v1);
+		h = kxxh_merge(h, v2);
+		h = kxxh_merge(h, v3);
+		h = kxxh_merge(h, v4);
+	}
+	else
+		h = seed + KXXH_PRIME5;
+
+	h += (uint64)len;
+
+	while (p + 8 <= end)
+	{
+		h ^= kxxh_round(0, kxxh_read64(p));
+		h = kxxh_rotl(h, 27) * KXXH_PRIME1 + KXXH_PRIME4;
+		p += 8;
+	}
+	if (p + 4 <= end)
+	{
+		h ^= (uint64)kxxh_read32(p) * KXXH_PRIME1;
+		h = kxxh_rotl(h, 23) * KXXH_PRIME2 + KXXH_PRIME3;
+		p += 4;
+	}
+	while (p < end)
+	{
+		h ^= (uint64)(unsigned char)*p * KXXH_PRIME5;
+		h = kxxh_rotl(h, 11) * KXXH_PRIME1;
+		p++;
+	}
+
+	h ^= h >> 33;
+	h *= KXXH_PRIME2;
+	h ^= h >> 29;
+	h *= KXXH_PRIME3;
+	h ^= h >> 32;
+	return h;
+}
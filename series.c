@@ -1,4 +1,5 @@
 #include "timecache.h"
+#include "krandom.h"
 
 
 #include "pgtime.h"
@@ -43,6 +44,7 @@ typedef struct
 	int time_step_sign;
 	int current_value;
 	int value_step;
+	KRandom rng;
 } generate_series_randomwalk_fctx;
 
 // Container for storing sinewave generation values
@@ -57,16 +59,6 @@ typedef struct
 } 
 generate_series_sinewave_fctx;
 
-/// <summary>
-/// Random between 0.0 and 1.0
-/// </summary>
-/// <returns></returns>
-double randd()
-{
-	return (rand() / (RAND_MAX / (1.0)));
-}
-
-
 #ifndef M_PI
 	#define M_PI 3.14159265358979323846
 #endif
@@ -372,7 +364,7 @@ Datum generate_randomwalk_series(PG_FUNCTION_ARGS)
 
 	if (PG_NARGS() < 4)
 	{
-		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("generate_sinewave_series requires at least 4 arguments: start, end, interval, period. Optionally an 5th arg: amplitude")));
+		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("generate_randomwalk_series requires at least 4 arguments: start, end, interval, value step. Optionally a 5th arg: start value, and a 6th: seed")));
 	}
 
 	FuncCallContext* funcctx;
@@ -416,7 +408,7 @@ Datum generate_randomwalk_series(PG_FUNCTION_ARGS)
 		fctx->time_step = *step;
 		fctx->value_step = val_step;
 
-		if (PG_NARGS() == 5)
+		if (PG_NARGS() >= 5 && !PG_ARGISNULL(4))
 		{
 			fctx->current_value = PG_GETARG_INT32(4);
 		}
@@ -425,6 +417,8 @@ Datum generate_randomwalk_series(PG_FUNCTION_ARGS)
 			fctx->current_value = 0;
 		}
 
+		krandom_seed(&fctx->rng, krandom_seed_arg(fcinfo, 5), 0);
+
 
 		/* Determine sign of the interval */
 		MemSet(&interval_zero, 0, sizeof(Interval));
@@ -476,7 +470,7 @@ Datum generate_randomwalk_series(PG_FUNCTION_ARGS)
 					errmsg("timestamp out of range")));
 		}
 
-		double r = randd();
+		double r = krandom_unit(&fctx->rng);
 		if (r < 0.5)
 		{
 			fctx->current_value = fctx->current_value + fctx->value_step;
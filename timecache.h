@@ -11,9 +11,13 @@
 #include "utils/timestamp.h"
 #include "utils/date.h"
 #include "utils/datetime.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
 #include "common/int128.h"
 #include "math.h"
 
 #include <float.h>
+#include <limits.h>
 
 #include "stdlib.h"
\ No newline at end of file